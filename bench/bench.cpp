@@ -0,0 +1,172 @@
+#include "ProgramHierarchy.h"
+#include "RefactorTool.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/FileSystem.h"
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+
+// Форма синтетической TU.
+struct TUShape {
+    int64_t Classes;         // Всего классов.
+    int64_t Depth;           // Длина цепочек наследования; 1 - классы без баз.
+    int64_t VirtualMethods;  // Виртуальных методов у корня цепочки; наследники переопределяют их без override.
+    int64_t Loops;           // Циклов range-for с копированием элемента в каждом классе.
+};
+
+// Параметр формы, по которому строится кривая стоимости (он же N для оценки сложности).
+enum Dimension { Classes, Depth, VirtualMethods, Loops };
+
+// Генерирует TU без системных заголовков, чтобы время уходило на наш код, а не на разбор STL.
+// Корень каждой цепочки даёт совпадение nv-dtor, каждый наследник - VirtualMethods совпадений override,
+// каждый класс - Loops совпадений range-for, одно совпадение value-param (Item по значению)
+// и одно reserve (счётный цикл с push_back), последний класс цепочки - совпадение final.
+// std::vector - минимальная заглушка, не из STL.
+std::string generateTU(const TUShape &Shape) {
+    std::string code = "namespace std { template <class T> struct vector { void push_back(const T &); }; }\n"
+                       "struct Item { char data[64]; };\n"
+                       "struct Items { const Item *begin() const; const Item *end() const; };\n";
+    for (int64_t i = 0; i < Shape.Classes; ++i) {
+        const bool root = i % Shape.Depth == 0;
+        const std::string name = "C" + std::to_string(i);
+
+        code += "struct " + name + (root ? "" : " : C" + std::to_string(i - 1)) + " {\n";
+        if (root) {
+            code += "    ~" + name + "();\n";
+        }
+        for (int64_t m = 0; m < Shape.VirtualMethods; ++m) {
+            code += (root ? "    virtual void m" : "    void m") + std::to_string(m) + "();\n";
+        }
+        code += "    void loops(const Items &items, Item extra) {\n"
+                "        std::vector<int> out;\n"
+                "        for (int i = 0; i < 8; ++i) out.push_back(i);\n";
+        for (int64_t l = 0; l < Shape.Loops; ++l) {
+            code += "        for (const Item item : items) {}\n";
+        }
+        code += "    }\n};\n";
+    }
+    return code;
+}
+
+// Прогон инструмента в процессе: правки остаются в Collector, файлы не трогаются.
+bool runTool(const std::string &Code, const RefactorOptions &Options) {
+    ReplacementsCollector collector;
+    // -w: тысячи предупреждений в выводе бенчмарка не нужны, сами правки от этого не меняются.
+    return clang::tooling::runToolOnCodeWithArgs(std::make_unique<CodeRefactorAction>(Options, &collector), Code,
+                                                 {"-std=c++17", "-w"}, "bench.cpp");
+}
+
+// Иерархия программы из одной сгенерированной TU. Без неё проверка final не запускается,
+// и её кривые мерили бы пустой прогон. Собирается вне замера, как отдельная фаза --whole-program.
+std::shared_ptr<const ProgramHierarchy> collectHierarchy(const std::string &Code) {
+    llvm::SmallString<256> path;
+    int fd = -1;
+    if (llvm::sys::fs::createTemporaryFile("refactor_bench", "cpp", fd, path)) {
+        return nullptr;
+    }
+    auto remove = llvm::make_scope_exit([&] { llvm::sys::fs::remove(path); });
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << Code;
+    }
+    clang::tooling::FixedCompilationDatabase database(".", {"-std=c++17", "-w"});
+    auto hierarchy = ProgramHierarchy::collect(database, {std::string(path.str())}, 1);
+    return hierarchy ? std::make_shared<const ProgramHierarchy>(std::move(*hierarchy)) : nullptr;
+}
+
+void refactorBenchmark(benchmark::State &State, unsigned Checks, Dimension Scaled) {
+    const TUShape shape{State.range(Classes), State.range(Depth), State.range(VirtualMethods), State.range(Loops)};
+    const std::string code = generateTU(shape);
+
+    RefactorOptions options;
+    options.EnabledChecks = Checks;
+    if (options.isEnabled(Check::Final)) {
+        options.Program = collectHierarchy(code);
+        if (!options.Program) {
+            State.SkipWithError("cannot collect the class hierarchy of the generated TU");
+            return;
+        }
+    }
+
+    for (auto _ : State) {
+        if (!runTool(code, options)) {
+            State.SkipWithError("refactor_tool failed on the generated TU");
+            break;
+        }
+    }
+
+    State.SetComplexityN(State.range(Scaled));
+    State.counters["classes"] = static_cast<double>(shape.Classes);
+    State.counters["bytes"] = static_cast<double>(code.size());
+}
+
+// Для каждой проверки (и для всех вместе) строится кривая по каждому параметру формы,
+// остальные параметры фиксированы. Максимум по числу классов - 10k, случай из задачи про индекс иерархии.
+void registerBenchmarks() {
+    struct Curve {
+        const char *Name;
+        Dimension Scaled;
+        std::vector<std::vector<int64_t>> Args;  // Classes, Depth, VirtualMethods, Loops.
+    };
+    const Curve curves[] = {
+        {"classes", Classes, {{625, 1250, 2500, 5000, 10000}, {4}, {2}, {2}}},
+        {"depth", Depth, {{2048}, {1, 4, 16, 64, 256}, {2}, {2}}},
+        {"virtual_methods", VirtualMethods, {{1000}, {4}, {1, 4, 16, 64}, {2}}},
+        {"loops", Loops, {{1000}, {4}, {2}, {1, 4, 16, 64}}},
+    };
+
+    std::vector<std::pair<std::string, unsigned>> checks;
+    for (unsigned i = 0; i < NumChecks; ++i) {
+        checks.emplace_back(checkName(i), 1u << i);
+    }
+    checks.emplace_back("all", AllChecks);
+
+    for (const auto &[check, mask] : checks) {
+        for (const Curve &curve : curves) {
+            const std::string name = "refactor/" + check + "/" + curve.Name;
+            benchmark::RegisterBenchmark(name.c_str(), refactorBenchmark, mask, curve.Scaled)
+                ->ArgNames({"classes", "depth", "virtuals", "loops"})
+                ->ArgsProduct(curve.Args)
+                ->Unit(benchmark::kMillisecond)
+                ->Complexity();
+        }
+    }
+}
+
+// Печатает результаты как обычно и запоминает кривые, для которых подобрана сложность хуже N log N.
+class ScalingReporter : public benchmark::ConsoleReporter {
+public:
+    void ReportRuns(const std::vector<Run> &Reports) override {
+        for (const Run &run : Reports) {
+            if (run.report_big_o && (run.complexity == benchmark::oNSquared || run.complexity == benchmark::oNCubed)) {
+                Superlinear.push_back(run.benchmark_name());
+            }
+        }
+        ConsoleReporter::ReportRuns(Reports);
+    }
+
+    std::vector<std::string> Superlinear;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    registerBenchmarks();
+
+    ScalingReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+
+    // Ненулевой код возврата, чтобы квадратичный обход ловился в CI без разбора вывода.
+    for (const std::string &name : reporter.Superlinear) {
+        llvm::errs() << "Superlinear scaling: " << name << "\n";
+    }
+    return reporter.Superlinear.empty() ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Общий для всех TU прогона кэш файловой системы (--file-cache): результаты stat (в том числе
+// отрицательные - поиск заголовков по include-путям в основном из них и состоит) и содержимое файлов.
+// Содержимое читается один раз (крупные файлы через mmap) и отдаётся всем TU без копирования.
+// Потокобезопасен; сам по себе не FileSystem - потокам выдаются лёгкие CachingFileSystem поверх него.
+class SharedFileCache {
+public:
+    struct Entry {
+        llvm::ErrorOr<llvm::vfs::Status> Status = std::error_code();
+        std::unique_ptr<llvm::MemoryBuffer> Contents;  // Для файлов; читается при первом открытии.
+    };
+
+    // Key - абсолютный путь без "." (".." остаётся), по нему ищется запись; FS спрашивается по Path как есть.
+    std::shared_ptr<const Entry> status(llvm::StringRef Key, const llvm::Twine &Path, llvm::vfs::FileSystem &FS);
+    // Возвращает запись с прочитанным содержимым или ошибку открытия/чтения.
+    llvm::ErrorOr<std::shared_ptr<const Entry>> contents(llvm::StringRef Key, const llvm::Twine &Path,
+                                                         llvm::vfs::FileSystem &FS);
+
+    // Запись на диск прошла мимо кэша: подменяет содержимое и размер, чтобы следующие TU
+    // видели новую версию файла без повторного чтения с диска.
+    void overlay(llvm::StringRef Path, llvm::StringRef Contents);
+    // Забывает файлы, изменённые извне (--watch).
+    void invalidate(const std::vector<std::string> &Paths);
+
+    // Лёгкая FileSystem для одного потока поверх Base: свой рабочий каталог, общий кэш.
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
+    createFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> Base);
+
+private:
+    std::shared_ptr<const Entry> find(llvm::StringRef Path);
+    std::shared_ptr<const Entry> insert(llvm::StringRef Path, std::shared_ptr<const Entry> New);
+    // Забывает записи с "..", которые могут указывать на файл Path (вызывается под Mutex).
+    // Схлопнуть ".." текстуально для поиска нельзя, а для инвалидации лишняя запись не страшна.
+    void forgetAliases(llvm::StringRef Path);
+
+    std::mutex Mutex;
+    llvm::StringMap<std::shared_ptr<const Entry>> Entries;
+};
+
+// FileSystem одного потока: относительные пути разрешает по своему рабочему каталогу,
+// а stat и чтение файлов берёт из SharedFileCache.
+class CachingFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+    CachingFileSystem(SharedFileCache &Cache, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> Base)
+        : ProxyFileSystem(std::move(Base)), Cache(Cache) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &Path) override;
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &Path) override;
+
+private:
+    std::string cacheKey(const llvm::Twine &Path) const;
+
+    SharedFileCache &Cache;
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include "RefactorTool.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+
+// Формат вывода --dry-run.
+enum class DryRunFormat {
+    Diff,   // unified diff каждого исправленного файла
+    Stats,  // число правок по проверкам
+    Sarif,  // SARIF 2.1.0: предупреждения с исправлениями
+};
+
+// Вывод --dry-run. Результат каждой TU печатается сразу по её завершении и дальше не хранится:
+// между TU здесь остаются только счётчики и список исправленных файлов. Исключение - дифф заголовков:
+// их исходный текст и правки всех TU копятся до finish, чтобы каждый файл попал в вывод одним диффом.
+// Кроме этого с числом правок растёт только 64-битный хэш каждой показанной правки в ReplacementsCollector
+// (см. keepClaimHashesOnly). Потокобезопасен.
+class DryRunReport {
+public:
+    // Содержимое файла в том виде, в каком его разобрала TU.
+    using ContentsFn = llvm::function_ref<std::optional<llvm::StringRef>(llvm::StringRef Path)>;
+
+    DryRunReport(llvm::raw_ostream &OS, DryRunFormat Format);
+
+    void addTranslationUnit(llvm::StringRef File, const TranslationUnitResult &Result, ContentsFn Contents);
+    // Печатает диффы заголовков (diff), итоговые счётчики (stats) или окончание документа (sarif).
+    void finish();
+
+private:
+    // Заголовок, исправленный хотя бы одной TU (только для diff).
+    struct PendingHeader {
+        std::string Original;
+        clang::tooling::Replacements Replaces;
+    };
+
+    void writeFileDiff(llvm::StringRef Path, llvm::StringRef Original, const clang::tooling::Replacements &Replaces);
+    void writeSarifResult(const Finding &Result);
+
+    std::mutex Mutex;
+    std::string WorkingDir;  // Пути в диффе даются относительно него, чтобы дифф принимали git apply и patch -p1.
+    llvm::raw_ostream &OS;
+    DryRunFormat Format;
+    unsigned TranslationUnits = 0;
+    unsigned Edits[NumChecks] = {};
+    std::set<std::string> EditedFiles;
+    size_t SarifResults = 0;
+    std::map<std::string, PendingHeader> Headers;
+};
+
+// Пишет в OS unified diff (как diff -u) между Original и результатом применения к нему Replaces.
+// OldName и NewName попадают в заголовки "---" и "+++".
+void writeUnifiedDiff(llvm::raw_ostream &OS, llvm::StringRef OldName, llvm::StringRef NewName,
+                      llvm::StringRef Original, const clang::tooling::Replacements &Replaces, unsigned Context = 3);
@@ -0,0 +1,38 @@
+#pragma once
+#include "llvm/ADT/StringRef.h"
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Слежение за изменением файлов для --watch (inotify; на других платформах isValid() == false).
+// Следим за каталогами, а не за самими файлами: редакторы часто сохраняют файл через
+// временный файл и rename, после чего watch на исходный inode больше не срабатывает.
+class FileWatcher {
+public:
+    FileWatcher();
+    ~FileWatcher();
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    bool isValid() const { return Fd >= 0; }
+
+    // Начинает следить за файлом по абсолютному пути.
+    void watch(llvm::StringRef Path);
+
+    // Блокируется до изменения хотя бы одного отслеживаемого файла и возвращает изменённые пути (по возрастанию).
+    // События, пришедшие в пределах Debounce друг от друга (сохранение нескольких файлов сразу),
+    // возвращаются одним списком. Пустой список - ошибка чтения событий.
+    std::vector<std::string> waitForChanges(std::chrono::milliseconds Debounce = std::chrono::milliseconds(100));
+
+private:
+    // Дочитывает доступные события; false при ошибке.
+    bool readEvents(std::set<std::string> &Changed);
+
+    int Fd = -1;
+    std::map<int, std::string> Directories;  // Дескриптор watch -> каталог.
+    std::set<std::string> WatchedDirectories;
+    std::set<std::string> Files;
+};
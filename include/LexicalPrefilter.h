@@ -0,0 +1,14 @@
+#pragma once
+#include "RefactorTool.h"
+
+// Быстрый предварительный просмотр main file сырым лексером, без препроцессора и Sema.
+// Возвращает false, только если в коде заведомо нет кандидатов для включённых проверок:
+//   nv-dtor   - нет токена '~';
+//   override  - нет class/struct со списком баз (одиночное ':' в заголовке класса);
+//   range-for - нет for (... : ...);
+//   value-param - нет скобок, похожих на параметр невстроенного типа без & и *;
+//   reserve   - нет вызовов push_back/emplace_back;
+//   final     - нет ни virtual, ни класса со списком баз (только с --whole-program).
+// Консервативен: с --header-filter (правки возможны в заголовках) и при наличии #define
+// (макрос может скрыть заголовок класса или цикл) всегда возвращает true.
+bool mayHaveCandidates(llvm::StringRef Code, const RefactorOptions &Options);
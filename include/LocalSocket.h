@@ -0,0 +1,50 @@
+#pragma once
+#include "llvm/ADT/StringRef.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+// Соединение с клиентом refactor_tool serve. Сообщения - строки, разделённые '\n'.
+class LocalSocketConnection {
+public:
+    explicit LocalSocketConnection(int Fd) : Fd(Fd) {}
+    ~LocalSocketConnection();
+    LocalSocketConnection(const LocalSocketConnection &) = delete;
+    LocalSocketConnection &operator=(const LocalSocketConnection &) = delete;
+
+    // Читает следующую строку (без '\n'); false, если клиент закрыл соединение или произошла ошибка.
+    bool readLine(std::string &Line);
+    bool write(llvm::StringRef Data);
+
+private:
+    int Fd;
+    std::string Buffer;  // Прочитанное, но ещё не выданное readLine.
+};
+
+// Сервер на Unix domain socket для refactor_tool serve (POSIX; на других платформах isValid() == false).
+class LocalSocketServer {
+public:
+    // Слушает сокет по пути Path. Оставшийся от прошлого запуска сокет удаляется; если по пути лежит
+    // не сокет или к нему подключается другой живой сервер, сервер не запускается (isValid() == false).
+    explicit LocalSocketServer(llvm::StringRef Path);
+    // Закрывает сокет и удаляет его файл.
+    ~LocalSocketServer();
+    LocalSocketServer(const LocalSocketServer &) = delete;
+    LocalSocketServer &operator=(const LocalSocketServer &) = delete;
+
+    bool isValid() const { return Fd >= 0; }
+    // Почему не удалось начать слушать, если !isValid().
+    const std::string &error() const { return Error; }
+
+    // Ждёт следующее соединение; nullptr после shutdown() или при ошибке.
+    std::unique_ptr<LocalSocketConnection> accept();
+    // Прерывает accept в другом потоке; новые соединения больше не принимаются.
+    void shutdown() { Stopped = true; }
+
+private:
+    int Fd = -1;
+    std::string Path;
+    std::string Error;
+    std::atomic<bool> Stopped{false};
+};
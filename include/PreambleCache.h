@@ -0,0 +1,26 @@
+#pragma once
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "clang/Basic/FileManager.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Общий для прогона кэш прекомпилированных преамбул (блока #include в начале файла), как в clangd.
+// Преамбула собирается один раз и переиспользуется всеми TU с тем же текстом преамбулы
+// и совместимыми флагами (CompilerInvocation::getModuleHash), так что тяжёлые заголовки
+// вроде <iostream> и <vector> разбираются один раз на прогон, а не на каждую TU.
+class PreambleCache {
+public:
+    // Подключает к Invocation подходящую преамбулу, при необходимости собирая её.
+    // Если преамбулу собрать не удалось, Invocation остаётся без изменений и TU разбирается как обычно.
+    void attach(clang::CompilerInvocation &Invocation, clang::FileManager &Files,
+                std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps);
+
+private:
+    std::mutex Mutex;
+    std::map<std::string, std::shared_ptr<const clang::PrecompiledPreamble>> Preambles;
+};
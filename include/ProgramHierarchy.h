@@ -0,0 +1,32 @@
+#pragma once
+#include "clang/AST/DeclCXX.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Иерархия классов всей программы (--whole-program): имена классов, от которых наследуется
+// хотя бы один класс в какой-либо TU базы компиляции. В отличие от ClassHierarchyIndex,
+// видит наследников из других TU, поэтому по ней можно решить, что класс - лист.
+// Классы сравниваются по полному имени; специализации шаблона считаются одним классом,
+// а совпадение имён из разных анонимных пространств лишь делает ответ консервативнее.
+class ProgramHierarchy {
+public:
+    // Разбирает все TU в Jobs потоков. std::nullopt, если какая-то TU не разобралась:
+    // неполная иерархия могла бы объявить листом класс, у которого есть наследник.
+    static std::optional<ProgramHierarchy> collect(const clang::tooling::CompilationDatabase &Compilations,
+                                                   const std::vector<std::string> &Files, unsigned Jobs);
+
+    bool hasDescendants(const clang::CXXRecordDecl *Record) const;
+
+    // Хэш содержимого; входит в RefactorOptions::fingerprint, т.к. от иерархии зависят правки.
+    std::string fingerprint() const;
+
+    // Ключ класса в иерархии.
+    static std::string nameOf(const clang::CXXRecordDecl *Record);
+
+private:
+    llvm::StringSet<> Bases;
+};
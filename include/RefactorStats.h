@@ -0,0 +1,45 @@
+#pragma once
+#include "RefactorTool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Время в миллисекундах, прошедшее с момента Since.
+inline double elapsedMs(std::chrono::steady_clock::time_point Since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Since).count();
+}
+
+// Сводная статистика прогона для --stats: время по фазам, счётчики по проверкам,
+// самые медленные TU и пиковое потребление памяти. Потокобезопасна.
+class RefactorStats {
+public:
+    void addTranslationUnit(llvm::StringRef File, const TranslationUnitStats &Stats, double TotalMs);
+    void addCacheHit();
+    void addPrefiltered();
+    // Фазы вне отдельных TU, например применение правок в конце прогона.
+    void addPhase(llvm::StringRef Phase, double Ms);
+
+    void print(llvm::raw_ostream &OS) const;
+
+    // Пиковый RSS процесса в байтах (0, если платформа его не сообщает).
+    static size_t peakRSS();
+    // Текущий RSS процесса в байтах (0, если платформа его не сообщает).
+    static size_t currentRSS();
+
+private:
+    static constexpr size_t SlowestCount = 10;
+
+    mutable std::mutex Mutex;
+    unsigned TranslationUnits = 0;
+    unsigned CacheHits = 0;
+    unsigned Prefiltered = 0;  // TU, пропущенные лексическим префильтром.
+    double TotalMs = 0;
+    TranslationUnitStats Total;                          // Суммы по всем TU.
+    std::vector<std::pair<double, std::string>> Slowest;  // (время, строка отчёта), по убыванию.
+    std::map<std::string, double> Phases;
+};
@@ -1,58 +1,430 @@
 #pragma once
+#include "CachingFileSystem.h"
+#include "PreambleCache.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Refactoring.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Regex.h"
 
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_set>
+#include <vector>
 
-class RefactorHandler : public clang::ast_matchers::MatchFinder::MatchCallback {
+class RefactorStats;
+class ProgramHierarchy;
+class DryRunReport;
+
+// Правки, сгруппированные по абсолютному пути файла (как в clang::tooling::RefactoringTool).
+using FileReplacements = std::map<std::string, clang::tooling::Replacements>;
+
+// Проверки, которые можно включать и выключать через --checks.
+// Значение - бит в маске; номер бита - индекс проверки в статистике и в checkName.
+enum class Check : unsigned {
+    NvDtor = 1u << 0,      // nv-dtor: невиртуальный деструктор у базового класса
+    Override = 1u << 1,    // override: переопределение без override
+    RangeFor = 1u << 2,    // range-for: копирование элемента в range-for
+    ValueParam = 1u << 3,  // value-param: дорогой параметр, принимаемый по значению
+    Reserve = 1u << 4,     // reserve: рост вектора/строки в цикле с известным числом итераций без reserve
+    Final = 1u << 5,       // final: полиморфный класс без наследников во всей программе (--whole-program)
+};
+constexpr unsigned NumChecks = 6;
+constexpr unsigned AllChecks = (1u << NumChecks) - 1;
+// Проверки, которым нужны тела функций (см. RefactorOptions::SkipFunctionBodies).
+constexpr unsigned BodyChecks = static_cast<unsigned>(Check::RangeFor) | static_cast<unsigned>(Check::ValueParam) |
+                                static_cast<unsigned>(Check::Reserve);
+
+constexpr unsigned checkIndex(Check C) {
+    unsigned index = 0;
+    while (!((static_cast<unsigned>(C) >> index) & 1u)) {
+        ++index;
+    }
+    return index;
+}
+
+// Имя проверки в --checks по её индексу.
+const char *checkName(unsigned Index);
+
+// Разбирает список вида "nv-dtor,override,range-for" в маску проверок; "all" - все проверки.
+std::optional<unsigned> parseChecks(llvm::StringRef List);
+
+// Счётчики и замеры времени одной TU для --stats.
+struct TranslationUnitStats {
+    std::chrono::steady_clock::time_point Started;
+    double ParseMs = 0;  // От начала TU до HandleTranslationUnit: препроцессор, парсинг и Sema.
+    double IndexMs = 0;  // Построение ClassHierarchyIndex и AddressTakenIndex.
+    double MatchMs = 0;  // Finder.matchAST вместе с обработчиками.
+    unsigned Matches[NumChecks] = {};
+    unsigned Edits[NumChecks] = {};
+    double HandlerMs[NumChecks] = {};
+};
+
+// Предупреждение вместе с правками, которые его исправляют (для --dry-run --format=sarif).
+struct Finding {
+    unsigned CheckIndex = 0;
+    std::string File;  // Абсолютный путь.
+    unsigned Line = 0;
+    unsigned Column = 0;
+    std::string Message;
+    std::vector<clang::tooling::Replacement> Edits;
+};
+
+// Результат обработки одной TU: правки, выданные предупреждения и файлы, от которых она зависит.
+// Используется для передачи в ReplacementsCollector и для сохранения в кэш результатов.
+struct TranslationUnitResult {
+    FileReplacements Replaces;
+    std::vector<std::string> Warnings;      // В виде "file:line:col: warning: message".
+    std::vector<std::string> Dependencies;  // Абсолютные пути; заполняются только для кэша.
+    TranslationUnitStats Stats;             // В кэш не попадает.
+    std::vector<Finding> Findings;          // В кэш не попадает.
+    // Хэши исправленных файлов в том виде, в каком их разобрала TU (см. ReplacementsCollector::recordSource).
+    std::map<std::string, uint64_t> SourceHashes;
+
+    void merge(const TranslationUnitResult &Other);
+};
+
+// Настройки прогона, общие для всех TU.
+struct RefactorOptions {
+    // Маска включённых проверок (Check). Выключенные матчеры не регистрируются в MatchFinder.
+    unsigned EnabledChecks = AllChecks;
+    bool isEnabled(Check C) const { return EnabledChecks & static_cast<unsigned>(C); }
+
+    // Регулярное выражение для заголовков, которые тоже разрешено править.
+    // Пустая строка - правится только main file, как раньше.
+    std::string HeaderFilter;
+
+    // Не разбирать тела функций там, где их нельзя править (заголовки вне HeaderFilter),
+    // а если выключены все проверки из BodyChecks - нигде: остальным проверкам тела не нужны.
+    bool SkipFunctionBodies = false;
+
+    // range-for и value-param: копия считается дорогой, если тип не тривиально копируемый
+    // или его размер больше порога в байтах. Дешёвые копии не трогаем.
+    uint64_t RangeForCopyThreshold = 32;
+
+    // Прикладывать к каждому предупреждению fix-it с правкой (режим плагина clang).
+    // На сами правки не влияет, поэтому в fingerprint не входит.
+    bool EmitFixIts = false;
+
+    // Иерархия классов всей программы (--whole-program). Без неё проверка final не запускается,
+    // а nv-dtor видит только наследников из той же TU.
+    std::shared_ptr<const ProgramHierarchy> Program;
+
+    // Строка со всеми настройками, влияющими на результат; входит в ключ кэша результатов.
+    std::string fingerprint() const;
+};
+
+// Потокобезопасный накопитель правок со всех TU прогона.
+// Одинаковые правки из разных TU схлопываются, а файлы переписываются один раз в конце.
+class ReplacementsCollector {
+public:
+    void add(const FileReplacements &Replaces);
+
+    // Резервирует за текущей TU все части одного исправления разом. Для каждой части возвращает true,
+    // если она новая, и false, если та же правка (файл, смещение, текст) уже получена из другой TU -
+    // например, при обработке общего заголовка.
+    std::vector<bool> claim(llvm::ArrayRef<clang::tooling::Replacement> Parts);
+
+    // Для --dry-run: правки не применяются и не выгружаются, поэтому claim запоминает не сами правки,
+    // а их 64-битные хэши по файлам - 8 байт на правку вместо её текста. add, apply и exportTo
+    // после этого не используются.
+    void keepClaimHashesOnly() { ClaimHashesOnly = true; }
+
+    // Число накопленных и ещё не применённых правок.
+    size_t pendingEdits();
+    // Файлы, которые перепишет apply.
+    std::vector<std::string> editedFiles();
+
+    // Запоминает хэш содержимого Path, которое видела TU при разборе (первый вызов для файла).
+    void recordSource(llvm::StringRef Path, uint64_t Hash);
+
+    // Применяет накопленные правки к файлам на диске: каждый файл пишется один раз, через временный
+    // файл и rename, так что прерванный прогон не оставляет файлов, записанных наполовину.
+    // Конфликтующие правки отбрасываются с сообщением; файл, изменившийся на диске после разбора,
+    // не трогается. Written, если задан, получает новое содержимое каждого записанного файла (--watch
+    // подменяет его в кэше файлов). Возвращает false, если хотя бы один файл не удалось обновить.
+    bool apply(llvm::function_ref<void(llvm::StringRef Path, llvm::StringRef Contents)> Written = nullptr);
+
+    // Включает выгрузку правок в YAML (формат clang::tooling::TranslationUnitReplacements,
+    // который понимает clang-apply-replacements). Правки каждой TU дописываются в файл
+    // сразу по её завершении, исходники при этом не трогаются.
+    bool exportTo(llvm::StringRef Path);
+    // Дописывает окончание YAML-документа и хэши исходников (комментариями "# SourceHash:", которые
+    // clang-apply-replacements пропускает). Возвращает false при ошибке записи.
+    bool finishExport();
+    // Добавляет правки из YAML, выгруженного exportTo (например, отдельным шардом): повторы отбрасываются,
+    // хэши исходников проверяются в apply. Возвращает false, если файл не читается или разные выгрузки
+    // видели разное содержимое одного исходника.
+    bool importFrom(llvm::StringRef Path);
+
+private:
+    void writeYAML(const clang::tooling::Replacement &Edit);
+
+    // Правка без пути файла: путь уже есть ключом в Edits, а на длинных прогонах правок миллионы.
+    struct StoredEdit {
+        unsigned Offset;
+        unsigned Length;
+        std::string Text;
+
+        explicit StoredEdit(const clang::tooling::Replacement &Edit)
+            : Offset(Edit.getOffset()), Length(Edit.getLength()), Text(Edit.getReplacementText()) {}
+        bool operator<(const StoredEdit &Other) const {
+            return std::tie(Offset, Length, Text) < std::tie(Other.Offset, Other.Length, Other.Text);
+        }
+    };
+
+    std::mutex Mutex;
+    std::map<std::string, std::set<StoredEdit>> Edits;
+    bool ClaimHashesOnly = false;
+    std::map<std::string, std::unordered_set<uint64_t>> ClaimHashes;  // См. keepClaimHashesOnly.
+    std::map<std::string, uint64_t> SourceHashes;  // См. recordSource.
+    std::unique_ptr<llvm::raw_fd_ostream> FixesOut;
+    size_t ExportedCount = 0;
+};
+
+// Индекс иерархии классов единицы трансляции.
+// Строится одним обходом AST, после чего вопрос "есть ли у класса наследники" решается за O(1),
+// а не повторным обходом всей TU на каждый найденный деструктор.
+class ClassHierarchyIndex {
+public:
+    // Обходит TU и запоминает все классы, от которых кто-то наследуется напрямую.
+    void build(clang::ASTContext &Context);
+    void clear() { BasesWithDescendants.clear(); }
+
+    // Есть ли у класса хотя бы один наследник (прямой или косвенный).
+    bool hasDescendants(const clang::CXXRecordDecl *Record) const;
+
+private:
+    llvm::DenseSet<const clang::CXXRecordDecl *> BasesWithDescendants;  // Канонические декларации баз.
+};
+
+// Функции единицы трансляции, на которые есть ссылки не в позиции вызываемой функции:
+// взятие адреса, указатель на метод, передача как аргумента. Сигнатуру таких функций менять нельзя.
+// Строится одним обходом AST, как и ClassHierarchyIndex.
+class AddressTakenIndex {
+public:
+    void build(clang::ASTContext &Context);
+    void clear() { Functions.clear(); }
+
+    bool isAddressTaken(const clang::FunctionDecl *Function) const;
+
+private:
+    llvm::DenseSet<const clang::FunctionDecl *> Functions;  // Канонические декларации.
+};
+
+class RefactorHandler {
 public:
-    explicit RefactorHandler(clang::Rewriter &Rewrite) : Rewrite(Rewrite) {}
-    // Метод run вызывается для каждого совпадения с матчем.
-    // Мы проверяем тип совпадения по bind-именам и применяем рефакторинг.
-    virtual void run(const clang::ast_matchers::MatchFinder::MatchResult &Result) override;
+    using MatchResult = clang::ast_matchers::MatchFinder::MatchResult;
+
+    RefactorHandler(TranslationUnitResult &Output, const ClassHierarchyIndex &Hierarchy,
+                    const AddressTakenIndex &AddressTaken,
+                    const RefactorOptions &Options, ReplacementsCollector *Collector);
+
+    // Точки входа для совпадений конкретного матчера (см. CheckCallback).
+    void onNvDtor(const MatchResult &Result);
+    void onMissOverride(const MatchResult &Result);
+    void onRangeFor(const MatchResult &Result);
+    void onValueParam(const MatchResult &Result);
+    void onReserve(const MatchResult &Result);
+    void onFinal(const MatchResult &Result);
+
+    // Можно ли править код в Loc: main file или заголовок, подходящий под HeaderFilter.
+    bool isRefactorable(clang::SourceLocation Loc, const clang::SourceManager &SM);
 
 private:
     // 1. Невиртуальные деструкторы
-    void handle_nv_dtor(const clang::CXXDestructorDecl *Dtor, clang::ASTContext &Context,
-                        clang::DiagnosticsEngine &Diag, clang::SourceManager &SM);
+    void handle_nv_dtor(const clang::CXXDestructorDecl *Dtor, clang::DiagnosticsEngine &Diag,
+                        clang::SourceManager &SM);
 
     // 2. Методы без override
     void handle_miss_override(const clang::CXXMethodDecl *Method, clang::DiagnosticsEngine &Diag,
-                              clang::SourceManager &SM);
+                              clang::SourceManager &SM, const clang::LangOptions &LangOpts);
 
     // 3. range-for без &
-    void handle_crange_for(const clang::VarDecl *LoopVar, clang::DiagnosticsEngine &Diag, clang::SourceManager &SM);
+    void handle_crange_for(const clang::CXXForRangeStmt *Loop, const clang::VarDecl *LoopVar,
+                           clang::DiagnosticsEngine &Diag, clang::SourceManager &SM, clang::ASTContext &Context);
+
+    // 4. Дорогие параметры по значению
+    void handle_value_param(const clang::FunctionDecl *Function, clang::DiagnosticsEngine &Diag,
+                            clang::SourceManager &SM, clang::ASTContext &Context);
+
+    // 5. Рост контейнера в цикле без reserve
+    void handle_reserve(const clang::Stmt *Loop, const clang::VarDecl *Container, const clang::Expr *Push,
+                        clang::DiagnosticsEngine &Diag, clang::SourceManager &SM, clang::ASTContext &Context);
+
+    // 6. Листовые полиморфные классы без final
+    void handle_final(const clang::CXXRecordDecl *Record, clang::DiagnosticsEngine &Diag, clang::SourceManager &SM,
+                      const clang::LangOptions &LangOpts);
+
+    // Меняет тип параметра Index во всех объявлениях Function на const T&.
+    // Правки делаются, только если все объявления можно переписать.
+    bool makeConstRefParam(const clang::FunctionDecl *Function, unsigned Index, const clang::SourceManager &SM,
+                           const clang::LangOptions &LangOpts);
+
+    // Дорого ли копировать значение типа Type (см. RefactorOptions::RangeForCopyThreshold).
+    bool isExpensiveToCopy(clang::QualType Type, const clang::ASTContext &Context) const;
+
+    // Фиксирует правки, накопленные обработчиком (commitEdits), и, если они приняты, выдаёт предупреждение
+    // и запоминает его в Output, чтобы его можно было воспроизвести из кэша.
+    void report(clang::DiagnosticsEngine &Diag, const clang::SourceManager &SM, clang::SourceLocation Loc,
+                llvm::StringRef Message);
+
+    // Регистрирует вставку Text перед Loc (аналог Rewriter::InsertText). Правка только накапливается,
+    // в Output она попадает в report. Возвращает false, если место не переписываемо (макрос).
+    bool insertText(clang::SourceLocation Loc, llvm::StringRef Text, const clang::SourceManager &SM);
+
+    // Регистрирует замену диапазона токенов Range на Text (аналог Rewriter::ReplaceText).
+    bool replaceText(clang::SourceRange Range, llvm::StringRef Text, const clang::SourceManager &SM,
+                     const clang::LangOptions &LangOpts);
+
+    // Общая часть insertText и replaceText: замена Length байт начиная с Loc.
+    bool addEdit(clang::SourceLocation Loc, unsigned Length, llvm::StringRef Text, const clang::SourceManager &SM);
+
+    // Вставка после токена, начинающегося в Loc (аналог Rewriter::InsertTextAfterToken).
+    bool insertTextAfterToken(clang::SourceLocation Loc, llvm::StringRef Text, const clang::SourceManager &SM,
+                              const clang::LangOptions &LangOpts);
+
+    // Часть исправления, ещё не попавшая в Output.
+    struct StagedEdit {
+        clang::tooling::Replacement Edit;
+        clang::FixItHint FixIt;  // Пустая без EmitFixIts.
+    };
+
+    // Переносит накопленные части исправления в Output целиком или не переносит ни одной: если хоть одна
+    // конфликтует с уже сделанными правками, исправление отбрасывается и ничего не резервируется в Collector.
+    // Возвращает части, новые для прогона; пусто, если исправление отброшено или уже сделано.
+    std::vector<StagedEdit> commitEdits();
+
+    // Вызывает обработчик проверки C, засчитывая совпадение и время обработки в статистику TU.
+    template <typename Fn> void measure(Check C, Fn &&Handle);
+
+private:
+    TranslationUnitResult &Output;
+    const ClassHierarchyIndex &Hierarchy;
+    const AddressTakenIndex &AddressTaken;
+    const ProgramHierarchy *Program;                     // nullptr без --whole-program.
+    ReplacementsCollector *Collector;                    // Общий для прогона; nullptr в режиме правки по TU.
+    std::set<clang::tooling::Replacement> AppliedEdits;  // Защита от повторной вставки в одно место.
+    std::optional<llvm::Regex> HeaderFilter;
+    llvm::DenseMap<clang::FileID, bool> RefactorableFiles;  // Кэш решения isRefactorable по файлам.
+    unsigned CurrentCheck = 0;                              // Индекс проверки, которой засчитываются правки.
+    bool EmitFixIts;
+    uint64_t RangeForCopyThreshold;
+    std::vector<StagedEdit> StagedEdits;  // Части текущего исправления, см. commitEdits.
+};
+
+// MatchCallback одного матчера: сразу передаёт совпадение в свой метод RefactorHandler,
+// без перебора bind-имён всех проверок.
+class CheckCallback : public clang::ast_matchers::MatchFinder::MatchCallback {
+public:
+    using HandleFn = void (RefactorHandler::*)(const RefactorHandler::MatchResult &);
+
+    CheckCallback(RefactorHandler &Handler, HandleFn Handle) : Handler(Handler), Handle(Handle) {}
+    void run(const clang::ast_matchers::MatchFinder::MatchResult &Result) override { (Handler.*Handle)(Result); }
 
 private:
-    clang::Rewriter &Rewrite;
-    std::unordered_set<unsigned> virtualDtorLocations;
+    RefactorHandler &Handler;
+    HandleFn Handle;
 };
 
 class ComplexConsumer : public clang::ASTConsumer {
 public:
-    // Конструктор принимает Rewriter для изменения кода.
-    explicit ComplexConsumer(clang::Rewriter &Rewrite);
+    // Конструктор принимает контейнер, в который складываются правки.
+    ComplexConsumer(TranslationUnitResult &Output, const RefactorOptions &Options, ReplacementsCollector *Collector);
     // Метод HandleTranslationUnit вызывается для каждого файла.
     void HandleTranslationUnit(clang::ASTContext &Context) override;
+    // Вызывается парсером, только если включён FrontendOptions::SkipFunctionBodies.
+    bool shouldSkipFunctionBody(clang::Decl *D) override;
 
 private:
+    const RefactorOptions &Options;
+    TranslationUnitStats &Stats;
+    ClassHierarchyIndex Hierarchy;            // Индекс наследников, общий для всех обработчиков.
+    AddressTakenIndex AddressTaken;           // Функции, чью сигнатуру менять нельзя (value-param).
     RefactorHandler Handler;                  // Обработчик матчеров.
+    CheckCallback NvDtorCallback{Handler, &RefactorHandler::onNvDtor};
+    CheckCallback OverrideCallback{Handler, &RefactorHandler::onMissOverride};
+    CheckCallback RangeForCallback{Handler, &RefactorHandler::onRangeFor};
+    CheckCallback ValueParamCallback{Handler, &RefactorHandler::onValueParam};
+    CheckCallback ReserveCallback{Handler, &RefactorHandler::onReserve};
+    CheckCallback FinalCallback{Handler, &RefactorHandler::onFinal};
     clang::ast_matchers::MatchFinder Finder;  // MatchFinder для поиска узлов AST.
 };
 
 class CodeRefactorAction : public clang::ASTFrontendAction {
 public:
+    // Правки TU передаются в Collector и применяются в конце прогона. Без Collector файлы не меняются,
+    // исправленный main file можно получить строкой (setRewrittenOutput).
+    // Если задан Record, результат TU вместе со списком её зависимостей дописывается в него (для кэша).
+    explicit CodeRefactorAction(const RefactorOptions &Options, ReplacementsCollector *Collector = nullptr,
+                                TranslationUnitResult *Record = nullptr)
+        : Options(Options), Collector(Collector), Record(Record) {}
+
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &CI,
                                                                   clang::StringRef file) override;
     virtual bool BeginSourceFileAction(clang::CompilerInstance &CI) override;
     virtual void EndSourceFileAction() override;
 
+    // Если задано, по окончании TU её замеры передаются в общую статистику прогона (--stats).
+    void setStats(RefactorStats *RunStats) { Stats = RunStats; }
+    // Если задано (и нет Collector), исправленный main file пишется в строку.
+    void setRewrittenOutput(std::string *Code) { RewrittenOutput = Code; }
+    // Если задано, файлы не меняются: результат TU передаётся в отчёт --dry-run, а не в Collector.
+    void setDryRun(DryRunReport *Report) { DryRun = Report; }
+
 private:
     clang::Rewriter RewriterForCodeRefactor;
-};
\ No newline at end of file
+    TranslationUnitResult Output;
+    const RefactorOptions &Options;
+    ReplacementsCollector *Collector;
+    TranslationUnitResult *Record;
+    RefactorStats *Stats = nullptr;
+    std::string *RewrittenOutput = nullptr;
+    DryRunReport *DryRun = nullptr;
+    std::shared_ptr<clang::DependencyCollector> Dependencies;
+};
+
+// Фабрика действий для ClangTool: передаёт каждому CodeRefactorAction общий Collector.
+class CodeRefactorActionFactory : public clang::tooling::FrontendActionFactory {
+public:
+    explicit CodeRefactorActionFactory(const RefactorOptions &Options, ReplacementsCollector *Collector = nullptr,
+                                       TranslationUnitResult *Record = nullptr)
+        : Options(Options), Collector(Collector), Record(Record) {}
+    std::unique_ptr<clang::FrontendAction> create() override;
+
+    // Если задан кэш преамбул, каждая TU разбирается поверх общей прекомпилированной преамбулы.
+    void setPreambleCache(PreambleCache *Cache) { Preambles = Cache; }
+    void setStats(RefactorStats *RunStats) { Stats = RunStats; }
+    void setDryRun(DryRunReport *Report) { DryRun = Report; }
+    bool runInvocation(std::shared_ptr<clang::CompilerInvocation> Invocation, clang::FileManager *Files,
+                       std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps,
+                       clang::DiagnosticConsumer *DiagConsumer) override;
+
+private:
+    const RefactorOptions &Options;
+    ReplacementsCollector *Collector;
+    TranslationUnitResult *Record;
+    PreambleCache *Preambles = nullptr;
+    RefactorStats *Stats = nullptr;
+    DryRunReport *DryRun = nullptr;
+};
+
+// Рефакторинг кода в памяти, без файлов и без запуска процесса: возвращает исправленный текст
+// или std::nullopt, если код не компилируется. Args - флаги компиляции (например, "-std=c++20").
+std::optional<std::string> refactor(std::string_view Code, const RefactorOptions &Options = {},
+                                    const std::vector<std::string> &Args = {});
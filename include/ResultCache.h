@@ -0,0 +1,31 @@
+#pragma once
+#include "RefactorTool.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Постоянный кэш результатов по TU (по умолчанию в .refactor_cache/).
+// Ключ - хэш версии формата, настроек прогона, команд компиляции и содержимого main file.
+// Запись хранит правки, предупреждения и хэши всех файлов, прочитанных при разборе TU:
+// попадание засчитывается, только если ни один из них не изменился, и тогда TU не разбирается вовсе.
+// Рядом с хэшем запоминаются размер и время изменения файла; перечитывается и хэшируется
+// при проверке только тот файл, у которого они другие.
+// Хэши исправленных файлов, какими их видела TU, попадание отдаёт в TranslationUnitResult::SourceHashes.
+class ResultCache {
+public:
+    explicit ResultCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+    // std::nullopt, если main file не читается - такую TU кэшировать нельзя.
+    static std::optional<uint64_t> computeKey(const clang::tooling::CompilationDatabase &Compilations,
+                                              llvm::StringRef File, const RefactorOptions &Options);
+
+    std::optional<TranslationUnitResult> lookup(uint64_t Key) const;
+    // Запись атомарна (временный файл + rename), поэтому кэш можно делить между параллельными прогонами.
+    void store(uint64_t Key, const TranslationUnitResult &Result) const;
+
+private:
+    std::string entryPath(uint64_t Key) const;
+
+    std::string Dir;
+};
@@ -0,0 +1,179 @@
+#include "CachingFileSystem.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+
+namespace {
+// Буфер-представление содержимого записи кэша; держит запись живой, пока буфер нужен SourceManager.
+class SharedBuffer : public MemoryBuffer {
+public:
+    SharedBuffer(std::shared_ptr<const SharedFileCache::Entry> Owner, StringRef Name)
+        : Owner(std::move(Owner)), Name(Name.str()) {
+        StringRef data = this->Owner->Contents->getBuffer();
+        init(data.begin(), data.end(), /*RequiresNullTerminator=*/true);
+    }
+
+    StringRef getBufferIdentifier() const override { return Name; }
+    BufferKind getBufferKind() const override { return Owner->Contents->getBufferKind(); }
+
+private:
+    std::shared_ptr<const SharedFileCache::Entry> Owner;
+    std::string Name;
+};
+
+class CachedFile : public vfs::File {
+public:
+    CachedFile(std::shared_ptr<const SharedFileCache::Entry> Entry, vfs::Status Status)
+        : Entry(std::move(Entry)), Status(std::move(Status)) {}
+
+    ErrorOr<vfs::Status> status() override { return Status; }
+    ErrorOr<std::string> getName() override { return Status.getName().str(); }
+    ErrorOr<std::unique_ptr<MemoryBuffer>> getBuffer(const Twine &Name, int64_t, bool, bool) override {
+        return std::make_unique<SharedBuffer>(Entry, Name.str());
+    }
+    std::error_code close() override { return {}; }
+
+private:
+    std::shared_ptr<const SharedFileCache::Entry> Entry;
+    vfs::Status Status;
+};
+}  // namespace
+
+std::shared_ptr<const SharedFileCache::Entry> SharedFileCache::find(StringRef Path) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto it = Entries.find(Path);
+    return it == Entries.end() ? nullptr : it->second;
+}
+
+// Чтение идёт вне блокировки; если другой поток успел раньше, побеждает его запись.
+std::shared_ptr<const SharedFileCache::Entry> SharedFileCache::insert(StringRef Path,
+                                                                       std::shared_ptr<const Entry> New) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto [it, inserted] = Entries.try_emplace(Path, New);
+    if (!inserted && New->Contents && !it->second->Contents) {
+        it->second = New;  // Запись только со stat дополняем содержимым.
+    }
+    return it->second;
+}
+
+std::shared_ptr<const SharedFileCache::Entry> SharedFileCache::status(StringRef Key, const Twine &Path,
+                                                                       vfs::FileSystem &FS) {
+    if (auto entry = find(Key)) {
+        return entry;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->Status = FS.status(Path);
+    return insert(Key, std::move(entry));
+}
+
+ErrorOr<std::shared_ptr<const SharedFileCache::Entry>> SharedFileCache::contents(StringRef Key, const Twine &Path,
+                                                                                 vfs::FileSystem &FS) {
+    auto entry = find(Key);
+    if (entry && (entry->Contents || !entry->Status)) {
+        if (!entry->Status) {
+            return entry->Status.getError();
+        }
+        return entry;
+    }
+
+    auto file = FS.openFileForRead(Path);
+    if (!file) {
+        return file.getError();
+    }
+    auto loaded = std::make_shared<Entry>();
+    loaded->Status = (*file)->status();
+    if (!loaded->Status) {
+        return loaded->Status.getError();
+    }
+    // Не volatile: крупные файлы отображаются в память, а не копируются.
+    auto buffer = (*file)->getBuffer(Key, loaded->Status->getSize(), /*RequiresNullTerminator=*/true,
+                                     /*IsVolatile=*/false);
+    if (!buffer) {
+        return buffer.getError();
+    }
+    loaded->Contents = std::move(*buffer);
+    return insert(Key, std::move(loaded));
+}
+
+void SharedFileCache::forgetAliases(StringRef Path) {
+    std::vector<std::string> aliases;
+    for (const auto &entry : Entries) {
+        StringRef key = entry.getKey();
+        if (!key.contains("..")) {
+            continue;
+        }
+        SmallString<256> collapsed(key);
+        sys::path::remove_dots(collapsed, /*remove_dot_dot=*/true);
+        if (collapsed == Path) {
+            aliases.push_back(key.str());
+        }
+    }
+    for (const std::string &alias : aliases) {
+        Entries.erase(alias);
+    }
+}
+
+void SharedFileCache::overlay(StringRef Path, StringRef Contents) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    forgetAliases(Path);
+    auto it = Entries.find(Path);
+    if (it == Entries.end() || !it->second->Status) {
+        return;  // Файл ещё никто не читал - следующая TU прочитает новую версию с диска.
+    }
+
+    const vfs::Status &old = *it->second->Status;
+    auto entry = std::make_shared<Entry>();
+    entry->Status = vfs::Status(old.getName(), old.getUniqueID(), std::chrono::system_clock::now(), old.getUser(),
+                                old.getGroup(), Contents.size(), old.getType(), old.getPermissions());
+    entry->Contents = MemoryBuffer::getMemBufferCopy(Contents, Path);
+    it->second = std::move(entry);
+}
+
+void SharedFileCache::invalidate(const std::vector<std::string> &Paths) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    for (const std::string &path : Paths) {
+        Entries.erase(path);
+        forgetAliases(path);
+    }
+}
+
+IntrusiveRefCntPtr<vfs::FileSystem> SharedFileCache::createFileSystem(IntrusiveRefCntPtr<vfs::FileSystem> Base) {
+    return makeIntrusiveRefCnt<CachingFileSystem>(*this, std::move(Base));
+}
+
+std::string CachingFileSystem::cacheKey(const Twine &Path) const {
+    SmallString<256> path;
+    Path.toVector(path);
+    if (!sys::path::is_absolute(path)) {
+        if (auto cwd = getCurrentWorkingDirectory()) {
+            SmallString<256> absolute(*cwd);
+            sys::path::append(absolute, path);
+            path = absolute;
+        }
+    }
+    // ".." не схлопывается: после символической ссылки a/link/.. - не то же, что a.
+    sys::path::remove_dots(path, /*remove_dot_dot=*/false);
+    return std::string(path.str());
+}
+
+// Ключ нужен только для поиска в кэше; нижней FS передаётся исходный путь.
+ErrorOr<vfs::Status> CachingFileSystem::status(const Twine &Path) {
+    const std::string key = cacheKey(Path);
+    auto entry = Cache.status(key, Path, getUnderlyingFS());
+    if (!entry->Status) {
+        return entry->Status.getError();
+    }
+    // FileManager ожидает в Status тот путь, по которому спрашивали.
+    return vfs::Status::copyWithNewName(*entry->Status, Path.str());
+}
+
+ErrorOr<std::unique_ptr<vfs::File>> CachingFileSystem::openFileForRead(const Twine &Path) {
+    const std::string key = cacheKey(Path);
+    auto entry = Cache.contents(key, Path, getUnderlyingFS());
+    if (!entry) {
+        return entry.getError();
+    }
+    vfs::Status status = vfs::Status::copyWithNewName(*(*entry)->Status, Path.str());
+    return std::unique_ptr<vfs::File>(std::make_unique<CachedFile>(std::move(*entry), std::move(status)));
+}
@@ -0,0 +1,157 @@
+#include "RefactorTool.h"
+#include "DryRunReport.h"
+#include "RefactorStats.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+
+// Действие ClangTool для refactor_tool и refactor(): разбор TU, передача её результата в Collector,
+// кэш, статистику или отчёт --dry-run. Плагину clang оно не нужно и в него не входит.
+
+using namespace clang;
+using namespace clang::tooling;
+
+std::unique_ptr<ASTConsumer> CodeRefactorAction::CreateASTConsumer(CompilerInstance &CI, StringRef file) {
+    RewriterForCodeRefactor.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+    return std::make_unique<ComplexConsumer>(Output, Options, Collector);
+}
+
+namespace {
+// Для кэша важны и системные заголовки: их смена тоже должна инвалидировать результат.
+class AllDependenciesCollector : public DependencyCollector {
+public:
+    bool needSystemDependencies() override { return true; }
+
+    // Временный файл преамбулы не является входом TU и к следующему прогону исчезнет.
+    bool sawDependency(StringRef Filename, bool FromModule, bool IsSystem, bool IsModuleFile,
+                       bool IsMissing) override {
+        return !IsModuleFile && DependencyCollector::sawDependency(Filename, FromModule, IsSystem, IsModuleFile,
+                                                                   IsMissing);
+    }
+};
+}  // namespace
+
+bool CodeRefactorAction::BeginSourceFileAction(CompilerInstance &CI) {
+    Output.Stats.Started = std::chrono::steady_clock::now();
+
+    // Инициализируем Rewriter для рефакторинга.
+    RewriterForCodeRefactor.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+
+    // Парсер создаётся позже, в ExecuteAction, и читает флаг оттуда. Что именно пропускать,
+    // решает ComplexConsumer::shouldSkipFunctionBody.
+    if (Options.SkipFunctionBodies) {
+        CI.getFrontendOpts().SkipFunctionBodies = true;
+    }
+
+    // Препроцессор к этому моменту уже создан, поэтому подключаем сборщик зависимостей вручную.
+    // Регистрация в CI нужна, чтобы он увидел и заголовки из прекомпилированной преамбулы.
+    if (Record) {
+        Dependencies = std::make_shared<AllDependenciesCollector>();
+        Dependencies->attachToPreprocessor(CI.getPreprocessor());
+        CI.addDependencyCollector(Dependencies);
+    }
+    return true;  // Возвращаем true, чтобы продолжить обработку файла.
+}
+
+void CodeRefactorAction::EndSourceFileAction() {
+    // Результат TU нужен только до передачи в Collector, кэш или отчёт; дальше его держать незачем.
+    auto release = llvm::make_scope_exit([&] { Output = TranslationUnitResult(); });
+
+    if (Stats) {
+        Stats->addTranslationUnit(getCurrentFile(), Output.Stats, elapsedMs(Output.Stats.Started));
+    }
+
+    if (Record || Collector) {
+        // Правки применяются в конце прогона (или в следующем, из кэша): запоминаем, к какой версии файла
+        // они относятся.
+        SourceManager &SM = getCompilerInstance().getSourceManager();
+        for (const auto &[path, replaces] : Output.Replaces) {
+            if (auto entry = SM.getFileManager().getOptionalFileRef(path)) {
+                if (auto buffer = SM.getBufferDataOrNone(SM.translateFile(*entry))) {
+                    Output.SourceHashes[path] = llvm::xxh3_64bits(llvm::arrayRefFromStringRef(*buffer));
+                }
+            }
+        }
+    }
+
+    if (Record) {
+        FileManager &files = getCompilerInstance().getFileManager();
+        for (const std::string &dependency : Dependencies->getDependencies()) {
+            llvm::SmallString<256> path(dependency);
+            files.makeAbsolutePath(path);
+            llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+            Output.Dependencies.push_back(std::string(path.str()));
+        }
+        Record->merge(Output);
+    }
+
+    if (DryRun) {
+        // Файлы не меняются: результат TU сразу уходит в отчёт, содержимое берётся из буферов этой TU.
+        SourceManager &SM = getCompilerInstance().getSourceManager();
+        DryRun->addTranslationUnit(getCurrentFile(), Output, [&](StringRef Path) -> std::optional<StringRef> {
+            if (auto entry = SM.getFileManager().getOptionalFileRef(Path)) {
+                return SM.getBufferDataOrNone(SM.translateFile(*entry));
+            }
+            return std::nullopt;
+        });
+        return;
+    }
+
+    if (Collector) {
+        for (const auto &[path, hash] : Output.SourceHashes) {
+            Collector->recordSource(path, hash);
+        }
+        Collector->add(Output.Replaces);
+        return;
+    }
+
+    // Без Collector (refactor()) файлы на диске не меняются: исправленный main file отдаётся строкой.
+    if (RewrittenOutput) {
+        for (const auto &[path, replaces] : Output.Replaces) {
+            tooling::applyAllReplacements(replaces, RewriterForCodeRefactor);
+        }
+        SourceManager &SM = RewriterForCodeRefactor.getSourceMgr();
+        if (const auto *buffer = RewriterForCodeRefactor.getRewriteBufferFor(SM.getMainFileID())) {
+            *RewrittenOutput = std::string(buffer->begin(), buffer->end());
+        } else {
+            *RewrittenOutput = SM.getBufferData(SM.getMainFileID()).str();
+        }
+    }
+}
+
+std::unique_ptr<FrontendAction> CodeRefactorActionFactory::create() {
+    auto action = std::make_unique<CodeRefactorAction>(Options, Collector, Record);
+    action->setStats(Stats);
+    action->setDryRun(DryRun);
+    return action;
+}
+
+bool CodeRefactorActionFactory::runInvocation(std::shared_ptr<CompilerInvocation> Invocation, FileManager *Files,
+                                              std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                                              DiagnosticConsumer *DiagConsumer) {
+    if (Preambles) {
+        Preambles->attach(*Invocation, *Files, PCHContainerOps);
+    }
+    // AST, SourceManager и буферы должны освобождаться по окончании каждой TU, а не при выходе
+    // из процесса (как у clang -cc1 по умолчанию): иначе память прогона растёт с числом TU.
+    Invocation->getFrontendOpts().DisableFree = false;
+    return FrontendActionFactory::runInvocation(std::move(Invocation), Files, std::move(PCHContainerOps),
+                                                DiagConsumer);
+}
+
+std::optional<std::string> refactor(std::string_view Code, const RefactorOptions &Options,
+                                    const std::vector<std::string> &Args) {
+    // Как и ClangTool, явно указываем -resource-dir: иначе не найдутся встроенные заголовки clang.
+    static int resource_anchor;
+    std::vector<std::string> args(Args);
+    args.push_back("-resource-dir=" + CompilerInvocation::GetResourcesPath("refactor_tool", &resource_anchor));
+
+    std::string rewritten;
+    auto action = std::make_unique<CodeRefactorAction>(Options);
+    action->setRewrittenOutput(&rewritten);
+    if (!runToolOnCodeWithArgs(std::move(action), llvm::StringRef(Code), args, "input.cc")) {
+        return std::nullopt;
+    }
+    return rewritten;
+}
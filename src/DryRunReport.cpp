@@ -0,0 +1,307 @@
+#include "DryRunReport.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace clang::tooling;
+using llvm::StringRef;
+
+namespace {
+
+// Разбиение текста на строки; строка включает завершающий '\n'.
+class LineTable {
+public:
+    explicit LineTable(StringRef Text) : Text(Text) {
+        for (size_t i = 0; i + 1 < Text.size(); ++i) {
+            if (Text[i] == '\n') {
+                Starts.push_back(i + 1);
+            }
+        }
+    }
+
+    size_t size() const { return Starts.size(); }
+    size_t lineOf(size_t Offset) const {
+        return std::upper_bound(Starts.begin(), Starts.end(), Offset) - Starts.begin() - 1;
+    }
+    size_t begin(size_t Line) const { return Starts[Line]; }
+    size_t end(size_t Line) const { return Line + 1 < Starts.size() ? Starts[Line + 1] : Text.size(); }
+    StringRef line(size_t Line) const { return Text.slice(begin(Line), end(Line)); }
+
+private:
+    StringRef Text;
+    std::vector<size_t> Starts{0};
+};
+
+// Строки First..Last исходного файла заменяются на Text.
+struct LineChange {
+    size_t First;
+    size_t Last;
+    std::string Text;
+};
+
+template <typename Fn> void forEachLine(StringRef Text, Fn &&Callback) {
+    while (!Text.empty()) {
+        const size_t eol = Text.find('\n');
+        StringRef line = eol == StringRef::npos ? Text : Text.take_front(eol + 1);
+        Callback(line);
+        Text = Text.drop_front(line.size());
+    }
+}
+
+size_t countLines(StringRef Text) {
+    size_t count = 0;
+    forEachLine(Text, [&](StringRef) { ++count; });
+    return count;
+}
+
+void printLine(llvm::raw_ostream &OS, char Prefix, StringRef Line) {
+    OS << Prefix << Line;
+    if (Line.empty() || Line.back() != '\n') {
+        OS << "\n\\ No newline at end of file\n";
+    }
+}
+
+// URI файла для SARIF: абсолютный путь с экранированием всего, кроме безопасных символов.
+std::string fileURI(StringRef Path) {
+    std::string uri = "file://";
+    for (unsigned char c : Path) {
+        if (llvm::isAlnum(c) || StringRef("/-._~").contains(c)) {
+            uri += c;
+        } else {
+            uri += '%';
+            uri += llvm::hexdigit(c >> 4);
+            uri += llvm::hexdigit(c & 15);
+        }
+    }
+    return uri;
+}
+
+}  // namespace
+
+void writeUnifiedDiff(llvm::raw_ostream &OS, StringRef OldName, StringRef NewName, StringRef Original,
+                      const Replacements &Replaces, unsigned Context) {
+    const LineTable lines(Original);
+
+    // Правки, задевающие одни и те же строки, объединяются в одно изменение.
+    // Replacements упорядочены по смещению и не пересекаются.
+    std::vector<LineChange> changes;
+    size_t cursor = 0;
+    auto close = [&] {
+        if (!changes.empty()) {
+            changes.back().Text += Original.slice(cursor, lines.end(changes.back().Last));
+        }
+    };
+    for (const Replacement &edit : Replaces) {
+        const size_t offset = edit.getOffset();
+        const size_t first = lines.lineOf(offset);
+        const size_t last = edit.getLength() ? lines.lineOf(offset + edit.getLength() - 1) : first;
+        if (changes.empty() || first > changes.back().Last) {
+            close();
+            changes.push_back({first, last, ""});
+            cursor = lines.begin(first);
+        }
+        LineChange &change = changes.back();
+        change.Last = std::max(change.Last, last);
+        change.Text += Original.slice(cursor, offset);
+        change.Text += edit.getReplacementText();
+        cursor = offset + edit.getLength();
+    }
+    close();
+    if (changes.empty()) {
+        return;
+    }
+
+    OS << "--- " << OldName << "\n+++ " << NewName << "\n";
+    long delta = 0;  // Насколько новый файл длиннее старого до текущего блока.
+    for (size_t begin = 0; begin < changes.size();) {
+        // Изменения, между которыми не больше 2 * Context неизменных строк, печатаются одним блоком.
+        size_t end = begin + 1;
+        while (end < changes.size() && changes[end].First - changes[end - 1].Last - 1 <= 2 * Context) {
+            ++end;
+        }
+
+        const size_t from = changes[begin].First > Context ? changes[begin].First - Context : 0;
+        const size_t to = std::min(lines.size() - 1, changes[end - 1].Last + Context);
+        const long old_count = static_cast<long>(to - from + 1);
+        long new_count = old_count;
+        for (size_t i = begin; i < end; ++i) {
+            new_count += static_cast<long>(countLines(changes[i].Text)) -
+                         static_cast<long>(changes[i].Last - changes[i].First + 1);
+        }
+
+        OS << llvm::formatv("@@ -{0},{1} +{2},{3} @@\n", from + 1, old_count, static_cast<long>(from) + 1 + delta,
+                            new_count);
+        size_t line = from;
+        for (size_t i = begin; i < end; ++i) {
+            for (; line < changes[i].First; ++line) {
+                printLine(OS, ' ', lines.line(line));
+            }
+            for (; line <= changes[i].Last; ++line) {
+                printLine(OS, '-', lines.line(line));
+            }
+            forEachLine(changes[i].Text, [&](StringRef text) { printLine(OS, '+', text); });
+        }
+        for (; line <= to; ++line) {
+            printLine(OS, ' ', lines.line(line));
+        }
+
+        delta += new_count - old_count;
+        begin = end;
+    }
+}
+
+DryRunReport::DryRunReport(llvm::raw_ostream &OS, DryRunFormat Format) : OS(OS), Format(Format) {
+    llvm::SmallString<256> cwd;
+    if (!llvm::sys::fs::current_path(cwd)) {
+        WorkingDir = std::string(cwd.str()) + "/";
+    }
+    if (Format != DryRunFormat::Sarif) {
+        return;
+    }
+    // Документ открывается сразу, а результаты дописываются в массив results по мере завершения TU.
+    llvm::json::Array rules;
+    for (unsigned i = 0; i < NumChecks; ++i) {
+        rules.push_back(llvm::json::Object{{"id", checkName(i)}});
+    }
+    llvm::json::Object driver{{"name", "refactor_tool"}, {"rules", std::move(rules)}};
+    OS << R"({"$schema":"https://json.schemastore.org/sarif-2.1.0.json","version":"2.1.0",)"
+       << R"("runs":[{"tool":{"driver":)" << llvm::json::Value(std::move(driver)) << R"(},"results":[)";
+    OS.flush();
+}
+
+void DryRunReport::addTranslationUnit(StringRef File, const TranslationUnitResult &Result, ContentsFn Contents) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    ++TranslationUnits;
+    for (unsigned i = 0; i < NumChecks; ++i) {
+        Edits[i] += Result.Stats.Edits[i];
+    }
+    for (const auto &[path, replaces] : Result.Replaces) {
+        if (!replaces.empty()) {
+            EditedFiles.insert(path);
+        }
+    }
+
+    switch (Format) {
+    case DryRunFormat::Diff:
+        // Дифф main file печатается сразу. Заголовок могут исправить и другие TU, а два диффа одного файла
+        // git apply и patch не примут, поэтому правки заголовков копятся до finish. Правки, уже показанные
+        // для другой TU, сюда не доходят (их отсеял Collector).
+        for (const auto &[path, replaces] : Result.Replaces) {
+            if (replaces.empty()) {
+                continue;
+            }
+            auto original = Contents(path);
+            if (!original) {
+                llvm::errs() << "Cannot show the diff of " << path << ": the file is not available\n";
+                continue;
+            }
+            if (path == File) {
+                writeFileDiff(path, *original, replaces);
+                continue;
+            }
+            auto [header, inserted] = Headers.try_emplace(path);
+            if (inserted) {
+                header->second.Original = original->str();
+            }
+            for (const Replacement &edit : replaces) {
+                if (auto err = header->second.Replaces.add(edit)) {
+                    llvm::consumeError(std::move(err));
+                    llvm::errs() << "Conflicting edits of " << path << " from different translation units; "
+                                 << "the diff shows only the first one\n";
+                }
+            }
+        }
+        break;
+    case DryRunFormat::Stats: {
+        std::string counts;
+        for (unsigned i = 0; i < NumChecks; ++i) {
+            if (Result.Stats.Edits[i]) {
+                counts += llvm::formatv("{0}{1} {2}", counts.empty() ? "" : ", ", checkName(i), Result.Stats.Edits[i])
+                              .str();
+            }
+        }
+        if (!counts.empty()) {
+            OS << File << ": " << counts << "\n";
+        }
+        break;
+    }
+    case DryRunFormat::Sarif:
+        for (const Finding &finding : Result.Findings) {
+            writeSarifResult(finding);
+        }
+        break;
+    }
+    OS.flush();
+}
+
+void DryRunReport::writeFileDiff(StringRef Path, StringRef Original, const Replacements &Replaces) {
+    StringRef name(Path);
+    if (!WorkingDir.empty() && name.consume_front(WorkingDir)) {
+        writeUnifiedDiff(OS, "a/" + name.str(), "b/" + name.str(), Original, Replaces);
+    } else {
+        writeUnifiedDiff(OS, Path, Path, Original, Replaces);
+    }
+}
+
+void DryRunReport::writeSarifResult(const Finding &Result) {
+    llvm::json::Object location{
+        {"physicalLocation",
+         llvm::json::Object{{"artifactLocation", llvm::json::Object{{"uri", fileURI(Result.File)}}},
+                            {"region", llvm::json::Object{{"startLine", Result.Line},
+                                                          {"startColumn", Result.Column}}}}}};
+
+    // Правки одного предупреждения могут задевать несколько файлов (например, объявление в заголовке).
+    std::map<std::string, llvm::json::Array> replacements;
+    for (const Replacement &edit : Result.Edits) {
+        replacements[std::string(edit.getFilePath())].push_back(llvm::json::Object{
+            {"deletedRegion", llvm::json::Object{{"charOffset", edit.getOffset()}, {"charLength", edit.getLength()}}},
+            {"insertedContent", llvm::json::Object{{"text", edit.getReplacementText()}}}});
+    }
+    llvm::json::Array changes;
+    for (auto &[path, edits] : replacements) {
+        changes.push_back(llvm::json::Object{{"artifactLocation", llvm::json::Object{{"uri", fileURI(path)}}},
+                                             {"replacements", std::move(edits)}});
+    }
+
+    llvm::json::Object result{{"ruleId", checkName(Result.CheckIndex)},
+                              {"level", "warning"},
+                              {"message", llvm::json::Object{{"text", Result.Message}}},
+                              {"locations", llvm::json::Array{std::move(location)}}};
+    if (!changes.empty()) {
+        result["fixes"] = llvm::json::Array{llvm::json::Object{{"artifactChanges", std::move(changes)}}};
+    }
+    OS << (SarifResults++ ? "," : "") << llvm::json::Value(std::move(result));
+}
+
+void DryRunReport::finish() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    switch (Format) {
+    case DryRunFormat::Diff:
+        for (const auto &[path, header] : Headers) {
+            writeFileDiff(path, header.Original, header.Replaces);
+        }
+        Headers.clear();
+        break;
+    case DryRunFormat::Stats: {
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumChecks; ++i) {
+            total += Edits[i];
+        }
+        OS << llvm::formatv("Dry run: {0} edit(s) in {1} file(s) from {2} translation unit(s)\n", total,
+                            EditedFiles.size(), TranslationUnits);
+        for (unsigned i = 0; i < NumChecks; ++i) {
+            OS << llvm::formatv("  {0,-12} {1}\n", checkName(i), Edits[i]);
+        }
+        break;
+    }
+    case DryRunFormat::Sarif:
+        OS << "]}]}\n";
+        break;
+    }
+    OS.flush();
+}
@@ -0,0 +1,82 @@
+#include "FileWatcher.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Path.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+FileWatcher::FileWatcher() : Fd(inotify_init1(IN_CLOEXEC)) {}
+
+FileWatcher::~FileWatcher() {
+    if (Fd >= 0) {
+        close(Fd);
+    }
+}
+
+void FileWatcher::watch(llvm::StringRef Path) {
+    if (Fd < 0 || !Files.insert(Path.str()).second) {
+        return;
+    }
+
+    std::string dir = llvm::sys::path::parent_path(Path).str();
+    if (!WatchedDirectories.insert(dir).second) {
+        return;
+    }
+    int wd = inotify_add_watch(Fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd >= 0) {
+        Directories[wd] = dir;
+    }
+}
+
+bool FileWatcher::readEvents(std::set<std::string> &Changed) {
+    alignas(inotify_event) char buffer[16 * 1024];
+    ssize_t size = read(Fd, buffer, sizeof(buffer));
+    if (size <= 0) {
+        return false;
+    }
+
+    for (char *ptr = buffer; ptr < buffer + size;) {
+        const auto *event = reinterpret_cast<const inotify_event *>(ptr);
+        ptr += sizeof(inotify_event) + event->len;
+
+        auto dir = Directories.find(event->wd);
+        if (dir == Directories.end() || event->len == 0) {
+            continue;
+        }
+        llvm::SmallString<256> path(dir->second);
+        llvm::sys::path::append(path, event->name);
+        if (Files.count(std::string(path.str()))) {
+            Changed.insert(std::string(path.str()));
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> FileWatcher::waitForChanges(std::chrono::milliseconds Debounce) {
+    std::set<std::string> changed;
+    while (changed.empty()) {
+        if (!readEvents(changed)) {
+            return {};
+        }
+    }
+
+    // Ждём, пока поток событий не стихнет, чтобы не перезапускаться на каждом файле по отдельности.
+    pollfd fd{Fd, POLLIN, 0};
+    while (poll(&fd, 1, static_cast<int>(Debounce.count())) > 0) {
+        if (!readEvents(changed)) {
+            break;
+        }
+    }
+    return {changed.begin(), changed.end()};
+}
+#else
+FileWatcher::FileWatcher() = default;
+FileWatcher::~FileWatcher() = default;
+void FileWatcher::watch(llvm::StringRef) {}
+bool FileWatcher::readEvents(std::set<std::string> &) { return false; }
+std::vector<std::string> FileWatcher::waitForChanges(std::chrono::milliseconds) { return {}; }
+#endif
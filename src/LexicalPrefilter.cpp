@@ -0,0 +1,246 @@
+#include "LexicalPrefilter.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/StringSwitch.h"
+
+using namespace clang;
+
+namespace {
+bool isBuiltinType(llvm::StringRef Name) {
+    return llvm::StringSwitch<bool>(Name)
+        .Cases("void", "bool", "char", "wchar_t", "char8_t", "char16_t", "char32_t", true)
+        .Cases("short", "int", "long", "float", "double", "signed", "unsigned", "auto", true)
+        .Default(false);
+}
+
+bool isQualifier(llvm::StringRef Name) {
+    return llvm::StringSwitch<bool>(Name)
+        .Cases("const", "volatile", "struct", "class", "typename", "enum", "register", true)
+        .Default(false);
+}
+
+// Ключевые слова, после которых скобки - не список параметров функции.
+bool opensNonParameterList(llvm::StringRef Name) {
+    return llvm::StringSwitch<bool>(Name)
+        .Cases("for", "if", "while", "switch", "catch", "return", "throw", true)
+        .Cases("sizeof", "alignof", "alignas", "decltype", "noexcept", "static_assert", "typeid", true)
+        .Default(false);
+}
+
+// Ищет параметры вида `T name` или `T` без ссылки и указателя, где T - не встроенный тип.
+// Вызов g(x, y) лексически неотличим от void g(X, Y), поэтому одиночный идентификатор считается
+// кандидатом, только если за скобками идёт тело функции или список инициализации.
+class ValueParamScanner {
+public:
+    bool feed(const Token &Tok) {
+        bool found = false;
+        if (AwaitBody) {
+            AwaitBody = false;
+            // Тело, список инициализации, возвращаемый тип, cv- и ref-квалификаторы или requires.
+            found = Tok.isOneOf(tok::l_brace, tok::colon, tok::arrow, tok::amp, tok::ampamp) ||
+                    (Tok.is(tok::raw_identifier) &&
+                     llvm::StringSwitch<bool>(Tok.getRawIdentifier())
+                         .Cases("const", "volatile", "noexcept", "try", "override", "final", "requires", true)
+                         .Default(false));
+        }
+
+        switch (Tok.getKind()) {
+        case tok::l_paren:
+            if (Groups.size() > 256) {
+                Groups.clear();  // Несбалансированные скобки (#if): лучше потерять контекст, чем память.
+            }
+            Groups.push_back({PrevOpensParameters, {}, false});
+            break;
+        case tok::r_paren:
+            if (!Groups.empty()) {
+                found |= finish(Groups.back());
+                AwaitBody = Groups.back().HasSingle;
+                Groups.pop_back();
+            }
+            break;
+        case tok::comma:
+            if (!Groups.empty()) {
+                found |= finish(Groups.back());
+                Groups.back().Current = {};
+            }
+            break;
+        case tok::equal:
+            // Аргумент по умолчанию: сам параметр закончился, дальше выражение.
+            if (!Groups.empty()) {
+                found |= finish(Groups.back());
+                Groups.back().Current.Done = true;
+            }
+            break;
+        case tok::raw_identifier:
+            if (!Groups.empty()) {
+                Segment &segment = Groups.back().Current;
+                llvm::StringRef name = Tok.getRawIdentifier();
+                if (!isQualifier(name)) {
+                    if (segment.Idents++ == 0) {
+                        segment.Builtin = isBuiltinType(name);
+                    }
+                }
+            }
+            break;
+        case tok::coloncolon:
+        case tok::less:
+        case tok::greater:
+        case tok::numeric_constant:
+        case tok::ellipsis:
+        case tok::l_square:
+        case tok::r_square:
+            break;  // Допустимы в записи типа.
+        default:
+            // Ссылки, указатели и любые операторы: не параметр по значению или вовсе выражение.
+            if (!Groups.empty()) {
+                Groups.back().Current.NotParameter = true;
+            }
+            break;
+        }
+
+        PrevOpensParameters = Tok.isOneOf(tok::greater, tok::r_paren) ||
+                              (Tok.is(tok::raw_identifier) && !opensNonParameterList(Tok.getRawIdentifier()));
+        return found;
+    }
+
+private:
+    struct Segment {
+        unsigned Idents = 0;        // Идентификаторы, кроме const/struct и т.п.
+        bool Builtin = false;       // Первый из них - встроенный тип.
+        bool NotParameter = false;  // Встретилось что-то, чего не бывает в объявлении параметра.
+        bool Done = false;          // Параметр уже оценён (дальше аргумент по умолчанию).
+    };
+    struct Group {
+        bool Parameters;  // Скобки могут быть списком параметров.
+        Segment Current;
+        bool HasSingle;   // Был параметр из одного идентификатора (или вызов с одним аргументом).
+    };
+
+    bool finish(Group &G) {
+        const Segment &segment = G.Current;
+        if (!G.Parameters || segment.Done || segment.NotParameter || segment.Builtin || segment.Idents == 0) {
+            return false;
+        }
+        if (segment.Idents >= 2) {
+            return true;
+        }
+        G.HasSingle = true;
+        return false;
+    }
+
+    std::vector<Group> Groups;
+    bool PrevOpensParameters = false;
+    bool AwaitBody = false;
+};
+}  // namespace
+
+bool mayHaveCandidates(llvm::StringRef Code, const RefactorOptions &Options) {
+    if (!Options.HeaderFilter.empty()) {
+        return true;
+    }
+
+    const bool want_dtor = Options.isEnabled(Check::NvDtor);
+    const bool want_override = Options.isEnabled(Check::Override);
+    const bool want_range_for = Options.isEnabled(Check::RangeFor);
+    const bool want_value_param = Options.isEnabled(Check::ValueParam);
+    const bool want_reserve = Options.isEnabled(Check::Reserve);
+    const bool want_final = Options.isEnabled(Check::Final) && Options.Program;
+    ValueParamScanner value_params;
+
+    LangOptions lang;
+    lang.CPlusPlus = lang.CPlusPlus11 = lang.CPlusPlus14 = lang.CPlusPlus17 = lang.CPlusPlus20 = 1;
+    lang.Bool = 1;
+    Lexer lexer(SourceLocation(), lang, Code.begin(), Code.begin(), Code.end());
+
+    bool after_hash = false;    // Предыдущий токен - '#' в начале строки.
+    bool class_head = false;    // Внутри заголовка class/struct до '{' или ';'.
+    int class_head_parens = 0;  // Глубина скобок alignas(...)/__declspec(...) в заголовке класса.
+    bool for_keyword = false;   // Предыдущий токен - for.
+    int for_depth = 0;          // Глубина скобок внутри заголовка for; 0 - не в заголовке.
+
+    Token tok;
+    bool eof = false;
+    while (!eof) {
+        eof = lexer.LexFromRawLexer(tok);
+        if (want_value_param && value_params.feed(tok)) {
+            return true;
+        }
+
+        if (tok.is(tok::raw_identifier)) {
+            llvm::StringRef name = tok.getRawIdentifier();
+            if (after_hash && name == "define") {
+                return true;
+            }
+            if (want_reserve && (name == "push_back" || name == "emplace_back")) {
+                return true;
+            }
+            if (want_final && name == "virtual") {
+                return true;
+            }
+            if ((want_override || want_final) && (name == "class" || name == "struct")) {
+                class_head = true;
+            }
+            if (want_range_for && name == "for") {
+                for_keyword = true;
+                after_hash = false;
+                continue;
+            }
+        }
+        after_hash = tok.is(tok::hash) && tok.isAtStartOfLine();
+
+        if (for_keyword) {
+            for_keyword = false;
+            if (tok.is(tok::l_paren)) {
+                for_depth = 1;
+                continue;
+            }
+        }
+
+        switch (tok.getKind()) {
+        case tok::tilde:
+            if (want_dtor) {
+                return true;
+            }
+            break;
+        case tok::colon:
+            if (class_head || for_depth == 1) {
+                return true;
+            }
+            break;
+        case tok::l_paren:
+            if (for_depth > 0) {
+                ++for_depth;
+            }
+            if (class_head) {
+                ++class_head_parens;  // struct alignas(16) D : Base - скобки пропускаются целиком.
+            }
+            break;
+        case tok::r_paren:
+            if (for_depth > 0) {
+                --for_depth;
+            }
+            if (class_head_parens > 0) {
+                --class_head_parens;
+            } else {
+                class_head = false;  // Параметр void f(struct S) закончился.
+            }
+            break;
+        case tok::semi:
+            // for_depth не сбрасывается: в for (auto v = get(); auto x : v) ':' идёт после ';'.
+            // Заголовок обычного for (init; cond; inc) закончится на своей ')'.
+            class_head = false;
+            class_head_parens = 0;
+            break;
+        case tok::l_brace:
+        case tok::greater:
+        case tok::comma:
+        case tok::equal:
+            if (class_head_parens == 0) {
+                class_head = false;  // Тело класса, параметр шаблона или enum class без базы.
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
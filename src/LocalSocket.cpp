@@ -0,0 +1,131 @@
+#include "LocalSocket.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+LocalSocketConnection::~LocalSocketConnection() { close(Fd); }
+
+bool LocalSocketConnection::readLine(std::string &Line) {
+    while (true) {
+        const size_t eol = Buffer.find('\n');
+        if (eol != std::string::npos) {
+            Line.assign(Buffer, 0, eol);
+            Buffer.erase(0, eol + 1);
+            return true;
+        }
+        char chunk[4096];
+        const ssize_t size = read(Fd, chunk, sizeof(chunk));
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return false;
+        }
+        Buffer.append(chunk, static_cast<size_t>(size));
+    }
+}
+
+bool LocalSocketConnection::write(llvm::StringRef Data) {
+    while (!Data.empty()) {
+        // MSG_NOSIGNAL есть не везде; закрытое клиентом соединение тогда даст SIGPIPE, а не EPIPE.
+#ifdef MSG_NOSIGNAL
+        const ssize_t size = send(Fd, Data.data(), Data.size(), MSG_NOSIGNAL);
+#else
+        const ssize_t size = send(Fd, Data.data(), Data.size(), 0);
+#endif
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return false;
+        }
+        Data = Data.drop_front(static_cast<size_t>(size));
+    }
+    return true;
+}
+
+LocalSocketServer::LocalSocketServer(llvm::StringRef Path) : Path(Path.str()) {
+    sockaddr_un address{};
+    if (Path.size() >= sizeof(address.sun_path)) {
+        Error = "the path is too long";
+        return;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, Path.data(), Path.size());
+
+    // Удаляем только сокет, оставшийся от завершившегося сервера: обычный файл по этому пути чужой,
+    // а сокет, к которому удаётся подключиться, ещё слушает другой сервер.
+    struct stat existing;
+    if (lstat(this->Path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            Error = "the path exists and is not a socket";
+            return;
+        }
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe < 0) {
+            Error = std::strerror(errno);
+            return;
+        }
+        const bool alive = connect(probe, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+        close(probe);
+        if (alive) {
+            Error = "another server is already listening there";
+            return;
+        }
+        unlink(this->Path.c_str());
+    }
+
+    Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Fd < 0) {
+        Error = std::strerror(errno);
+        return;
+    }
+    if (bind(Fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || listen(Fd, SOMAXCONN) != 0) {
+        Error = std::strerror(errno);
+        close(Fd);
+        Fd = -1;
+    }
+}
+
+LocalSocketServer::~LocalSocketServer() {
+    if (Fd >= 0) {
+        close(Fd);
+        unlink(Path.c_str());
+    }
+}
+
+std::unique_ptr<LocalSocketConnection> LocalSocketServer::accept() {
+    // accept с таймаутом, чтобы shutdown() из другого потока срабатывал без закрытия дескриптора.
+    pollfd fd{Fd, POLLIN, 0};
+    while (!Stopped) {
+        const int ready = poll(&fd, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            return nullptr;
+        }
+        if (ready > 0) {
+            const int client = ::accept(Fd, nullptr, nullptr);
+            if (client >= 0) {
+                return std::make_unique<LocalSocketConnection>(client);
+            }
+            if (errno != EINTR && errno != ECONNABORTED) {
+                return nullptr;
+            }
+        }
+    }
+    return nullptr;
+}
+#else
+LocalSocketConnection::~LocalSocketConnection() = default;
+bool LocalSocketConnection::readLine(std::string &) { return false; }
+bool LocalSocketConnection::write(llvm::StringRef) { return false; }
+LocalSocketServer::LocalSocketServer(llvm::StringRef Path)
+    : Path(Path.str()), Error("not supported on this platform") {}
+LocalSocketServer::~LocalSocketServer() = default;
+std::unique_ptr<LocalSocketConnection> LocalSocketServer::accept() { return nullptr; }
+#endif
@@ -0,0 +1,84 @@
+#include "PreambleCache.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+
+using namespace clang;
+
+void PreambleCache::attach(CompilerInvocation &Invocation, FileManager &Files,
+                           std::shared_ptr<PCHContainerOperations> PCHContainerOps) {
+    const auto &inputs = Invocation.getFrontendOpts().Inputs;
+    if (inputs.size() != 1 || !inputs[0].isFile()) {
+        return;
+    }
+
+    auto buffer = Files.getBufferForFile(inputs[0].getFile());
+    if (!buffer) {
+        return;
+    }
+
+    PreambleBounds bounds = ComputePreambleBounds(Invocation.getLangOpts(), (*buffer)->getMemBufferRef(), 0);
+    if (bounds.Size == 0) {
+        return;
+    }
+
+    // Ключ: совместимость флагов, каталог main file, аргументы без имени входного файла и точный текст
+    // преамбулы. От каталога и путей -I зависит, какой файл найдёт #include "config.h", а getModuleHash
+    // их не учитывает.
+    llvm::SmallString<256> main_dir(inputs[0].getFile());
+    Files.makeAbsolutePath(main_dir);
+    llvm::sys::path::remove_filename(main_dir);
+
+    std::string arguments;
+    const std::vector<std::string> command_line = Invocation.getCC1CommandLine();
+    for (size_t i = 0; i < command_line.size(); ++i) {
+        // Имя входного файла и -main-file-name у каждой TU свои, а на преамбулу они не влияют.
+        if (command_line[i] == inputs[0].getFile()) {
+            continue;
+        }
+        if ((command_line[i] == "-main-file-name" || command_line[i] == "-o") && i + 1 < command_line.size()) {
+            ++i;
+            continue;
+        }
+        arguments += command_line[i];
+        arguments += '\0';
+    }
+
+    llvm::StringRef preamble_text = (*buffer)->getBuffer().take_front(bounds.Size);
+    std::string key = Invocation.getModuleHash() + ":" + main_dir.str().str() + ":" +
+                      llvm::utohexstr(llvm::xxh3_64bits(llvm::arrayRefFromStringRef(arguments))) + ":" +
+                      llvm::utohexstr(llvm::xxh3_64bits(llvm::arrayRefFromStringRef(preamble_text)));
+
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs = Files.getVirtualFileSystemPtr();
+    std::shared_ptr<const PrecompiledPreamble> preamble;
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        auto it = Preambles.find(key);
+        if (it != Preambles.end()) {
+            preamble = it->second;
+        }
+    }
+
+    // CanReuse дополнительно проверяет, что заголовки преамбулы не менялись с момента сборки.
+    if (!preamble || !preamble->CanReuse(Invocation, (*buffer)->getMemBufferRef(), bounds, *vfs)) {
+        // Собираем вне блокировки: одновременная сборка одной преамбулы двумя потоками
+        // безвредна, а ждать чужую сборку на каждом ключе было бы дороже.
+        DiagnosticsEngine diagnostics(new DiagnosticIDs(), new DiagnosticOptions(), new IgnoringDiagConsumer());
+        PreambleCallbacks callbacks;
+        auto built = PrecompiledPreamble::Build(Invocation, buffer->get(), bounds, diagnostics, vfs, PCHContainerOps,
+                                                /*StoreInMemory=*/false, /*StoragePath=*/"", callbacks);
+        if (!built) {
+            return;
+        }
+        preamble = std::make_shared<const PrecompiledPreamble>(std::move(*built));
+
+        std::lock_guard<std::mutex> lock(Mutex);
+        Preambles[key] = preamble;
+    }
+
+    // Преамбула хранится во временном файле на диске, поэтому VFS не подменяется.
+    // Буфер main file переходит во владение SourceManager через remapped files.
+    preamble->AddImplicitPreamble(Invocation, vfs, buffer->release());
+}
@@ -0,0 +1,25 @@
+#include "ProgramHierarchy.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/xxhash.h"
+
+#include <algorithm>
+
+using namespace clang;
+
+bool ProgramHierarchy::hasDescendants(const CXXRecordDecl *Record) const {
+    return Record && Bases.count(nameOf(Record));
+}
+
+std::string ProgramHierarchy::fingerprint() const {
+    std::vector<llvm::StringRef> names;
+    names.reserve(Bases.size());
+    for (const auto &base : Bases) {
+        names.push_back(base.getKey());
+    }
+    std::sort(names.begin(), names.end());
+    return llvm::utohexstr(llvm::xxh3_64bits(llvm::arrayRefFromStringRef(llvm::join(names, "\n"))));
+}
+
+std::string ProgramHierarchy::nameOf(const CXXRecordDecl *Record) {
+    return Record->getCanonicalDecl()->getQualifiedNameAsString();
+}
@@ -0,0 +1,107 @@
+#include "ProgramHierarchy.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <atomic>
+#include <mutex>
+
+// Сбор иерархии прогоном ClangTool по всем TU. Отдельно от ProgramHierarchy.cpp, потому что плагин
+// компилирует тот, а ClangTool, фабрики действий и пул потоков в clang, загрузившем плагин, может не быть.
+
+using namespace clang;
+using namespace clang::tooling;
+
+namespace {
+// Тела функций разбираются: в них бывают локальные наследники (например, моки в тестах).
+// Инстанцирования шаблонов тоже: в CRTP-наследнике Mixin<Leaf> база известна только после подстановки.
+class BaseCollector : public RecursiveASTVisitor<BaseCollector> {
+public:
+    explicit BaseCollector(llvm::StringSet<> &bases) : bases_{bases} {}
+
+    bool shouldVisitTemplateInstantiations() const { return true; }
+
+    bool VisitCXXRecordDecl(CXXRecordDecl *decl) {
+        if (!decl->isThisDeclarationADefinition()) {
+            return true;
+        }
+        for (const CXXBaseSpecifier &base : decl->bases()) {
+            if (const CXXRecordDecl *base_decl = base.getType()->getAsCXXRecordDecl()) {
+                bases_.insert(ProgramHierarchy::nameOf(base_decl));
+            }
+        }
+        return true;
+    }
+
+private:
+    llvm::StringSet<> &bases_;
+};
+
+class BaseCollectorConsumer : public ASTConsumer {
+public:
+    explicit BaseCollectorConsumer(llvm::StringSet<> &Bases) : Bases(Bases) {}
+
+    void HandleTranslationUnit(ASTContext &Context) override {
+        BaseCollector(Bases).TraverseDecl(Context.getTranslationUnitDecl());
+    }
+
+private:
+    llvm::StringSet<> &Bases;
+};
+
+class BaseCollectorAction : public ASTFrontendAction {
+public:
+    explicit BaseCollectorAction(llvm::StringSet<> &Bases) : Bases(Bases) {}
+
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &, StringRef) override {
+        return std::make_unique<BaseCollectorConsumer>(Bases);
+    }
+
+private:
+    llvm::StringSet<> &Bases;
+};
+
+class BaseCollectorActionFactory : public FrontendActionFactory {
+public:
+    explicit BaseCollectorActionFactory(llvm::StringSet<> &Bases) : Bases(Bases) {}
+
+    std::unique_ptr<FrontendAction> create() override { return std::make_unique<BaseCollectorAction>(Bases); }
+
+private:
+    llvm::StringSet<> &Bases;
+};
+}  // namespace
+
+std::optional<ProgramHierarchy> ProgramHierarchy::collect(const CompilationDatabase &Compilations,
+                                                          const std::vector<std::string> &Files, unsigned Jobs) {
+    ProgramHierarchy hierarchy;
+    std::mutex mutex;
+    std::atomic<bool> failed{false};
+
+    // Как и в основном прогоне: своя TU и свой физический VFS на задачу.
+    llvm::DefaultThreadPool pool(llvm::hardware_concurrency(Jobs));
+    for (const std::string &file : Files) {
+        pool.async([&, file] {
+            llvm::StringSet<> bases;
+            BaseCollectorActionFactory factory(bases);
+            ClangTool tool(Compilations, file, std::make_shared<PCHContainerOperations>(),
+                           llvm::vfs::createPhysicalFileSystem());
+            if (tool.run(&factory)) {
+                failed = true;
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &base : bases) {
+                hierarchy.Bases.insert(base.getKey());
+            }
+        });
+    }
+    pool.wait();
+
+    if (failed) {
+        return std::nullopt;
+    }
+    return hierarchy;
+}
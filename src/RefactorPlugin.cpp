@@ -0,0 +1,98 @@
+#include "RefactorTool.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendPluginRegistry.h"
+
+// Плагин clang: те же проверки, что и в refactor_tool, но поверх AST обычной компиляции,
+// без отдельного разбора файла. Исходники не меняются: правки выдаются как fix-it
+// в предупреждениях или выгружаются в YAML для clang-apply-replacements.
+//
+//   clang++ -fplugin=libRefactorPlugin.so -fplugin-arg-refactor-export-fixes=a.yaml -c a.cpp
+//
+// Аргументы плагина (-fplugin-arg-refactor-<аргумент>):
+//   checks=<список>        - как --checks у refactor_tool;
+//   header-filter=<regex>  - как --header-filter;
+//   range-for-copy-threshold=<байт> - как --range-for-copy-threshold;
+//   export-fixes=<файл>    - записать правки TU в YAML вместо fix-it.
+
+using namespace clang;
+
+namespace {
+// Владеет всем, что нужно ComplexConsumer: у плагина нет EndSourceFileAction,
+// поэтому результат выгружается сразу после обхода AST.
+class RefactorPluginConsumer : public ASTConsumer {
+public:
+    RefactorPluginConsumer(const RefactorOptions &Options, std::string ExportFixes)
+        : Options(Options), ExportFixes(std::move(ExportFixes)),
+          Consumer(Output, this->Options, this->ExportFixes.empty() ? nullptr : &Collector) {}
+
+    void HandleTranslationUnit(ASTContext &Context) override {
+        // Для кода с ошибками правки не предлагаем: AST может быть неполным.
+        if (Context.getDiagnostics().hasErrorOccurred()) {
+            return;
+        }
+
+        Consumer.HandleTranslationUnit(Context);
+
+        if (!ExportFixes.empty() && Collector.exportTo(ExportFixes)) {
+            Collector.add(Output.Replaces);
+            Collector.finishExport();
+        }
+    }
+
+private:
+    RefactorOptions Options;
+    std::string ExportFixes;
+    TranslationUnitResult Output;
+    ReplacementsCollector Collector;
+    ComplexConsumer Consumer;
+};
+
+class RefactorPluginAction : public PluginASTAction {
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef File) override {
+        return std::make_unique<RefactorPluginConsumer>(Options, ExportFixes);
+    }
+
+    bool ParseArgs(const CompilerInstance &CI, const std::vector<std::string> &Args) override {
+        DiagnosticsEngine &diag = CI.getDiagnostics();
+        for (const std::string &arg : Args) {
+            auto [name, value] = StringRef(arg).split('=');
+            if (name == "checks") {
+                if (auto checks = parseChecks(value)) {
+                    Options.EnabledChecks = *checks;
+                    continue;
+                }
+            } else if (name == "header-filter") {
+                Options.HeaderFilter = value.str();
+                continue;
+            } else if (name == "range-for-copy-threshold") {
+                if (!value.getAsInteger(10, Options.RangeForCopyThreshold)) {
+                    continue;
+                }
+            } else if (name == "export-fixes") {
+                ExportFixes = value.str();
+                continue;
+            }
+
+            diag.Report(diag.getCustomDiagID(DiagnosticsEngine::Error, "invalid refactor plugin argument '%0'"))
+                << arg;
+            return false;
+        }
+
+        // При выгрузке в YAML fix-it не нужны: правки и так попадут в файл.
+        Options.EmitFixIts = ExportFixes.empty();
+        return true;
+    }
+
+    // Плагин работает рядом с основным действием (компиляцией), а не вместо него.
+    ActionType getActionType() override { return AddAfterMainAction; }
+
+private:
+    RefactorOptions Options;
+    std::string ExportFixes;
+};
+}  // namespace
+
+static FrontendPluginRegistry::Add<RefactorPluginAction>
+    X("refactor", "Adds virtual to base destructors, override to overriders and & to copying range-for loops "
+                  "and expensive by-value parameters");
@@ -0,0 +1,122 @@
+#include "RefactorStats.h"
+#include "llvm/Support/FormatVariadic.h"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+
+#include <algorithm>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+void RefactorStats::addTranslationUnit(llvm::StringRef File, const TranslationUnitStats &Stats, double TotalMs) {
+    std::string line = llvm::formatv("{0,10:F1} ms  (parse {1:F1}, index {2:F1}, match {3:F1})  {4}", TotalMs,
+                                     Stats.ParseMs, Stats.IndexMs, Stats.MatchMs, File)
+                           .str();
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    ++TranslationUnits;
+    this->TotalMs += TotalMs;
+    Total.ParseMs += Stats.ParseMs;
+    Total.IndexMs += Stats.IndexMs;
+    Total.MatchMs += Stats.MatchMs;
+    for (unsigned i = 0; i < NumChecks; ++i) {
+        Total.Matches[i] += Stats.Matches[i];
+        Total.Edits[i] += Stats.Edits[i];
+        Total.HandlerMs[i] += Stats.HandlerMs[i];
+    }
+
+    if (Slowest.size() < SlowestCount || TotalMs > Slowest.back().first) {
+        auto pos = std::find_if(Slowest.begin(), Slowest.end(), [&](const auto &tu) { return tu.first < TotalMs; });
+        Slowest.insert(pos, {TotalMs, std::move(line)});
+        if (Slowest.size() > SlowestCount) {
+            Slowest.pop_back();
+        }
+    }
+}
+
+void RefactorStats::addCacheHit() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    ++CacheHits;
+}
+
+void RefactorStats::addPrefiltered() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    ++Prefiltered;
+}
+
+void RefactorStats::addPhase(llvm::StringRef Phase, double Ms) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Phases[Phase.str()] += Ms;
+}
+
+void RefactorStats::print(llvm::raw_ostream &OS) const {
+    std::lock_guard<std::mutex> lock(Mutex);
+    OS << "===== refactor_tool statistics =====\n";
+    OS << llvm::formatv("Translation units: {0} parsed, {1} from cache, {2} skipped by prefilter\n\n",
+                        TranslationUnits, CacheHits, Prefiltered);
+
+    OS << llvm::formatv("{0,-24} {1,12}\n", "Phase", "Total ms");
+    OS << llvm::formatv("{0,-24} {1,12:F1}\n", "parse", Total.ParseMs);
+    OS << llvm::formatv("{0,-24} {1,12:F1}\n", "hierarchy index", Total.IndexMs);
+    OS << llvm::formatv("{0,-24} {1,12:F1}\n", "match", Total.MatchMs);
+    for (const auto &[phase, ms] : Phases) {
+        OS << llvm::formatv("{0,-24} {1,12:F1}\n", phase, ms);
+    }
+    OS << llvm::formatv("{0,-24} {1,12:F1}\n\n", "TU wall (sum)", TotalMs);
+
+    OS << llvm::formatv("{0,-12} {1,10} {2,10} {3,12}\n", "Check", "Matches", "Edits", "Handler ms");
+    for (unsigned i = 0; i < NumChecks; ++i) {
+        OS << llvm::formatv("{0,-12} {1,10} {2,10} {3,12:F1}\n", checkName(i), Total.Matches[i], Total.Edits[i],
+                            Total.HandlerMs[i]);
+    }
+
+    if (!Slowest.empty()) {
+        OS << "\nSlowest translation units:\n";
+        for (const auto &tu : Slowest) {
+            OS << tu.second << "\n";
+        }
+    }
+
+    OS << llvm::formatv("\nPeak RSS: {0:F1} MB\n", peakRSS() / (1024.0 * 1024.0));
+}
+
+size_t RefactorStats::peakRSS() {
+    struct rusage usage {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);  // На macOS уже в байтах.
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;  // На Linux в килобайтах.
+#endif
+}
+
+size_t RefactorStats::currentRSS() {
+#if defined(__linux__)
+    // Второе поле statm - число резидентных страниц.
+    auto statm = llvm::MemoryBuffer::getFileAsStream("/proc/self/statm");
+    if (!statm) {
+        return 0;
+    }
+    llvm::SmallVector<llvm::StringRef, 2> fields;
+    (*statm)->getBuffer().split(fields, ' ', /*MaxSplit=*/2);
+    size_t pages = 0;
+    if (fields.size() < 2 || fields[1].getAsInteger(10, pages)) {
+        return 0;
+    }
+    return pages * llvm::sys::Process::getPageSizeEstimate();
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info{};
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) !=
+        KERN_SUCCESS) {
+        return 0;
+    }
+    return static_cast<size_t>(info.resident_size);
+#else
+    return 0;
+#endif
+}
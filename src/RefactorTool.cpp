@@ -1,61 +1,236 @@
 #include "RefactorTool.h"
+#include "ProgramHierarchy.h"
+#include "RefactorStats.h"
 #include "clang/AST/ASTContext.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Analysis/Analyses/ExprMutationAnalyzer.h"
 #include "clang/Lex/Lexer.h"
-#include <unordered_set>
+#include "clang/Tooling/ReplacementsYaml.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/YAMLParser.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
 using namespace clang::tooling;
 
-static llvm::cl::OptionCategory ToolCategory("refactor-tool options");
-
-class ASTVisitor : public RecursiveASTVisitor<ASTVisitor> {
+namespace {
+// Собирает за один обход все классы, у которых есть прямые наследники.
+// Косвенные наследники отдельно не нужны: если C -> B -> A, то у A есть прямой наследник B.
+class HierarchyCollector : public RecursiveASTVisitor<HierarchyCollector> {
 public:
-    explicit ASTVisitor(const CXXRecordDecl *base_class) : base_class_{base_class}, has_descendants{false} {}
+    explicit HierarchyCollector(llvm::DenseSet<const CXXRecordDecl *> &bases) : bases_{bases} {}
 
     bool VisitCXXRecordDecl(CXXRecordDecl *decl) {
-        if (!decl->hasDefinition()) {
+        if (!decl->isThisDeclarationADefinition()) {
             return true;
         }
 
-        if (decl->isDerivedFrom(base_class_)) {
-            has_descendants = true;
-            return false;
+        for (const CXXBaseSpecifier &base : decl->bases()) {
+            // Зависимые базы (template <class T> struct D : T) не разрешимы, как и в isDerivedFrom.
+            if (const CXXRecordDecl *base_decl = base.getType()->getAsCXXRecordDecl()) {
+                bases_.insert(base_decl->getCanonicalDecl());
+            }
         }
 
         return true;
     }
 
-    bool hasDescendants() const { return has_descendants; }
+private:
+    llvm::DenseSet<const CXXRecordDecl *> &bases_;
+};
+
+// Собирает функции, на которые ссылаются не как на вызываемую функцию.
+// CallExpr посещается раньше своих детей, поэтому к моменту визита DeclRefExpr
+// ссылка из позиции callee уже запомнена.
+class AddressTakenCollector : public RecursiveASTVisitor<AddressTakenCollector> {
+public:
+    explicit AddressTakenCollector(llvm::DenseSet<const FunctionDecl *> &functions) : functions_{functions} {}
+
+    bool shouldVisitTemplateInstantiations() const { return true; }
+
+    bool VisitCallExpr(CallExpr *call) {
+        if (const auto *ref = dyn_cast_or_null<DeclRefExpr>(call->getCallee()->IgnoreParenImpCasts())) {
+            callees_.insert(ref);
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *ref) {
+        if (const auto *function = dyn_cast<FunctionDecl>(ref->getDecl()); function && !callees_.count(ref)) {
+            functions_.insert(function->getCanonicalDecl());
+            // &S<int>::f ссылается на инстанцирование, а править будем шаблон.
+            if (const FunctionDecl *pattern = function->getTemplateInstantiationPattern()) {
+                functions_.insert(pattern->getCanonicalDecl());
+            }
+        }
+        return true;
+    }
 
 private:
-    const CXXRecordDecl *base_class_;
-    bool has_descendants;
+    llvm::DenseSet<const FunctionDecl *> &functions_;
+    llvm::DenseSet<const DeclRefExpr *> callees_;
 };
+}  // namespace
+
+void ClassHierarchyIndex::build(ASTContext &Context) {
+    BasesWithDescendants.clear();
+    HierarchyCollector collector(BasesWithDescendants);
+    collector.TraverseDecl(Context.getTranslationUnitDecl());
+}
+
+bool ClassHierarchyIndex::hasDescendants(const CXXRecordDecl *Record) const {
+    return Record && BasesWithDescendants.count(Record->getCanonicalDecl());
+}
+
+void AddressTakenIndex::build(ASTContext &Context) {
+    Functions.clear();
+    AddressTakenCollector collector(Functions);
+    collector.TraverseDecl(Context.getTranslationUnitDecl());
+}
+
+bool AddressTakenIndex::isAddressTaken(const FunctionDecl *Function) const {
+    return Function && Functions.count(Function->getCanonicalDecl());
+}
+
+void TranslationUnitResult::merge(const TranslationUnitResult &Other) {
+    // Replacements::merge применяет правки последовательно, а здесь нужно объединение без дублей.
+    for (const auto &[path, replaces] : Other.Replaces) {
+        Replacements &target = Replaces[path];
+        for (const Replacement &edit : replaces) {
+            if (std::find(target.begin(), target.end(), edit) == target.end()) {
+                llvm::consumeError(target.add(edit));
+            }
+        }
+    }
+    Warnings.insert(Warnings.end(), Other.Warnings.begin(), Other.Warnings.end());
+    Dependencies.insert(Dependencies.end(), Other.Dependencies.begin(), Other.Dependencies.end());
+    SourceHashes.insert(Other.SourceHashes.begin(), Other.SourceHashes.end());
+    Findings.insert(Findings.end(), Other.Findings.begin(), Other.Findings.end());
+}
+
+const char *checkName(unsigned Index) {
+    static const char *const names[NumChecks] = {"nv-dtor", "override", "range-for", "value-param", "reserve", "final"};
+    return Index < NumChecks ? names[Index] : "unknown";
+}
+
+std::optional<unsigned> parseChecks(StringRef List) {
+    unsigned checks = 0;
+    llvm::SmallVector<StringRef, 4> names;
+    List.split(names, ',', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    for (StringRef name : names) {
+        name = name.trim();
+        if (name == "all") {
+            checks |= AllChecks;
+            continue;
+        }
+
+        unsigned index = 0;
+        while (index < NumChecks && name != checkName(index)) {
+            ++index;
+        }
+        if (index == NumChecks) {
+            return std::nullopt;
+        }
+        checks |= 1u << index;
+    }
+    return checks;
+}
 
-// Метод run вызывается для каждого совпадения с матчем.
-// Мы проверяем тип совпадения по bind-именам и применяем рефакторинг.
-void RefactorHandler::run(const MatchFinder::MatchResult &Result) {
-    auto &Diag = Result.Context->getDiagnostics();
-    auto &SM = *Result.SourceManager;  // Получаем SourceManager для проверки isInMainFile
+std::string RefactorOptions::fingerprint() const {
+    return "checks=" + std::to_string(EnabledChecks) + ";header-filter=" + HeaderFilter +
+           ";skip-bodies=" + (SkipFunctionBodies ? "1" : "0") +
+           ";range-for-copy-threshold=" + std::to_string(RangeForCopyThreshold) +
+           ";program=" + (Program ? Program->fingerprint() : "");
+}
 
+RefactorHandler::RefactorHandler(TranslationUnitResult &Output, const ClassHierarchyIndex &Hierarchy,
+                                 const AddressTakenIndex &AddressTaken, const RefactorOptions &Options,
+                                 ReplacementsCollector *Collector)
+    : Output(Output), Hierarchy(Hierarchy), AddressTaken(AddressTaken), Program(Options.Program.get()),
+      Collector(Collector),
+      EmitFixIts(Options.EmitFixIts), RangeForCopyThreshold(Options.RangeForCopyThreshold) {
+    if (!Options.HeaderFilter.empty()) {
+        HeaderFilter.emplace(Options.HeaderFilter);
+    }
+}
+
+template <typename Fn> void RefactorHandler::measure(Check C, Fn &&Handle) {
+    llvm::TimeTraceScope scope("Check", [&] { return std::string(checkName(checkIndex(C))); });
+    const auto started = std::chrono::steady_clock::now();
+    CurrentCheck = checkIndex(C);
+    // Части исправления, не дошедшие до report в прошлом совпадении (обработчик отказался на полпути),
+    // отбрасываются.
+    StagedEdits.clear();
+    ++Output.Stats.Matches[CurrentCheck];
+    Handle();
+    Output.Stats.HandlerMs[CurrentCheck] += elapsedMs(started);
+}
+
+// Каждый метод on* вызывается только для совпадений своего матчера.
+void RefactorHandler::onNvDtor(const MatchResult &Result) {
     if (const auto *Dtor = Result.Nodes.getNodeAs<CXXDestructorDecl>("classDecl")) {
-        handle_nv_dtor(Dtor, *Result.Context, Diag, SM);
+        measure(Check::NvDtor,
+                [&] { handle_nv_dtor(Dtor, Result.Context->getDiagnostics(), *Result.SourceManager); });
     }
+}
 
+void RefactorHandler::onMissOverride(const MatchResult &Result) {
     if (const auto *Method = Result.Nodes.getNodeAs<CXXMethodDecl>("methodDecl")) {
-        handle_miss_override(Method, Diag, SM);
+        measure(Check::Override, [&] {
+            handle_miss_override(Method, Result.Context->getDiagnostics(), *Result.SourceManager,
+                                 Result.Context->getLangOpts());
+        });
+    }
+}
+
+void RefactorHandler::onRangeFor(const MatchResult &Result) {
+    const auto *Loop = Result.Nodes.getNodeAs<CXXForRangeStmt>("loop");
+    const auto *LoopVar = Result.Nodes.getNodeAs<VarDecl>("loopVar");
+    if (Loop && LoopVar) {
+        measure(Check::RangeFor, [&] {
+            handle_crange_for(Loop, LoopVar, Result.Context->getDiagnostics(), *Result.SourceManager,
+                              *Result.Context);
+        });
+    }
+}
+
+void RefactorHandler::onValueParam(const MatchResult &Result) {
+    if (const auto *Function = Result.Nodes.getNodeAs<FunctionDecl>("function")) {
+        measure(Check::ValueParam, [&] {
+            handle_value_param(Function, Result.Context->getDiagnostics(), *Result.SourceManager, *Result.Context);
+        });
     }
+}
 
-    if (const auto *LoopVar = Result.Nodes.getNodeAs<VarDecl>("loopVar")) {
-        handle_crange_for(LoopVar, Diag, SM);
+void RefactorHandler::onReserve(const MatchResult &Result) {
+    const auto *Loop = Result.Nodes.getNodeAs<Stmt>("loop");
+    const auto *Container = Result.Nodes.getNodeAs<VarDecl>("container");
+    const auto *Push = Result.Nodes.getNodeAs<Expr>("push");
+    if (Loop && Container && Push) {
+        measure(Check::Reserve, [&] {
+            handle_reserve(Loop, Container, Push, Result.Context->getDiagnostics(), *Result.SourceManager,
+                           *Result.Context);
+        });
     }
 }
 
-void RefactorHandler::handle_nv_dtor(const CXXDestructorDecl *Dtor, ASTContext &Context, DiagnosticsEngine &Diag,
-                                     SourceManager &SM) {
-    if (!SM.isInMainFile(Dtor->getLocation())) {
+void RefactorHandler::onFinal(const MatchResult &Result) {
+    if (const auto *Record = Result.Nodes.getNodeAs<CXXRecordDecl>("leafClass")) {
+        measure(Check::Final, [&] {
+            handle_final(Record, Result.Context->getDiagnostics(), *Result.SourceManager,
+                         Result.Context->getLangOpts());
+        });
+    }
+}
+
+void RefactorHandler::handle_nv_dtor(const CXXDestructorDecl *Dtor, DiagnosticsEngine &Diag, SourceManager &SM) {
+    if (!isRefactorable(Dtor->getLocation(), SM)) {
         return;
     }
 
@@ -65,28 +240,21 @@ void RefactorHandler::handle_nv_dtor(const CXXDestructorDecl *Dtor, ASTContext &
         return;
     }
 
-    ASTVisitor visitor(base_class_def);
-    visitor.TraverseDecl(Context.getTranslationUnitDecl());
-
-    if (!visitor.hasDescendants()) {
+    // С --whole-program наследник может быть и в другой TU.
+    if (!Hierarchy.hasDescendants(base_class_def) && !(Program && Program->hasDescendants(base_class_def))) {
         return;
     }
 
-    unsigned loc = Dtor->getBeginLoc().getRawEncoding();
-    if (virtualDtorLocations.count(loc)) {
+    if (!insertText(Dtor->getLocation(), "virtual ", SM)) {
         return;
     }
 
-    Rewrite.InsertText(Dtor->getLocation(), "virtual ");
-    virtualDtorLocations.insert(loc);
-
-    const unsigned DiagID =
-        Diag.getCustomDiagID(DiagnosticsEngine::Warning, "non-virtual destructor in the base class; added 'virtual'");
-    Diag.Report(Dtor->getLocation(), DiagID);
+    report(Diag, SM, Dtor->getLocation(), "non-virtual destructor in the base class; added 'virtual'");
 }
 
-void RefactorHandler::handle_miss_override(const CXXMethodDecl *Method, DiagnosticsEngine &Diag, SourceManager &SM) {
-    if (!SM.isInMainFile(Method->getLocation())) {
+void RefactorHandler::handle_miss_override(const CXXMethodDecl *Method, DiagnosticsEngine &Diag, SourceManager &SM,
+                                           const LangOptions &LangOpts) {
+    if (!isRefactorable(Method->getLocation(), SM)) {
         return;
     }
 
@@ -101,87 +269,991 @@ void RefactorHandler::handle_miss_override(const CXXMethodDecl *Method, Diagnost
             return;
         }
 
-        Rewrite.InsertTextAfterToken(loc, " override");
-        const unsigned DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Warning,
-                                                     "the base method is overrided, but not marked; added 'override'");
-        Diag.Report(Method->getLocation(), DiagID);
+        if (!insertTextAfterToken(loc, " override", SM, LangOpts)) {
+            return;
+        }
+        report(Diag, SM, Method->getLocation(), "the base method is overrided, but not marked; added 'override'");
+    }
+}
+
+void RefactorHandler::handle_final(const CXXRecordDecl *Record, DiagnosticsEngine &Diag, SourceManager &SM,
+                                   const LangOptions &LangOpts) {
+    if (!Program || !isRefactorable(Record->getLocation(), SM)) {
+        return;
+    }
+
+    // final пишется после имени класса, поэтому безымянные классы пропускаем. Шаблоны тоже:
+    // их специализации в иерархии неотличимы, и лист для одного аргумента не лист для другого.
+    if (!Record->isPolymorphic() || Record->isUnion() || !Record->getIdentifier() ||
+        Record->getDescribedClassTemplate() || isa<ClassTemplateSpecializationDecl>(Record)) {
+        return;
+    }
+    if (Program->hasDescendants(Record)) {
+        return;
+    }
+
+    if (!insertTextAfterToken(Record->getLocation(), " final", SM, LangOpts)) {
+        return;
+    }
+    report(Diag, SM, Record->getLocation(), "polymorphic class has no subclasses in the program; added 'final'");
+}
+
+namespace {
+bool isStdPair(QualType Type) {
+    const auto *record = dyn_cast_or_null<ClassTemplateSpecializationDecl>(Type->getAsCXXRecordDecl());
+    return record && record->isInStdNamespace() && record->getName() == "pair";
+}
+
+// Тип элемента, из которого инициализируется переменная цикла: для `for (T x : range)`
+// инициализатор - разыменование итератора, возможно, обёрнутое в неявные преобразования.
+QualType elementType(const VarDecl *LoopVar) {
+    const Expr *init = LoopVar->getInit();
+    if (!init) {
+        return {};
+    }
+    init = init->IgnoreImplicit();
+    if (const auto *construct = dyn_cast<CXXConstructExpr>(init)) {
+        if (construct->getNumArgs() == 0) {
+            return {};
+        }
+        init = construct->getArg(0)->IgnoreImplicit();
+    }
+    return init->getType();
+}
+}  // namespace
+
+bool RefactorHandler::isExpensiveToCopy(QualType Type, const ASTContext &Context) const {
+    if (!Type.isTriviallyCopyableType(Context)) {
+        return true;
     }
+    return static_cast<uint64_t>(Context.getTypeSizeInChars(Type).getQuantity()) > RangeForCopyThreshold;
 }
 
-void RefactorHandler::handle_crange_for(const VarDecl *LoopVar, DiagnosticsEngine &Diag, SourceManager &SM) {
-    if (!SM.isInMainFile(LoopVar->getLocation())) {
+void RefactorHandler::handle_crange_for(const CXXForRangeStmt *Loop, const VarDecl *LoopVar,
+                                        DiagnosticsEngine &Diag, SourceManager &SM, ASTContext &Context) {
+    if (!isRefactorable(LoopVar->getLocation(), SM)) {
         return;
     }
 
     QualType var_type = LoopVar->getType();
-    if (!var_type.isConstQualified() || var_type->isReferenceType() || var_type->isFundamentalType()) {
+    if (var_type->isReferenceType() || var_type->isDependentType() || var_type->isIncompleteType() ||
+        !isExpensiveToCopy(var_type, Context)) {
         return;
     }
 
-    if (auto type_info = LoopVar->getTypeSourceInfo()) {
-        TypeLoc type_loc = type_info->getTypeLoc();
-        if (type_loc.isNull()) {
+    auto type_info = LoopVar->getTypeSourceInfo();
+    if (!type_info) {
+        return;
+    }
+    TypeLoc type_loc = type_info->getTypeLoc();
+    SourceLocation type_end = type_loc.getEndLoc();
+    if (type_loc.isNull() || type_end.isInvalid() || type_end.isMacroID()) {
+        return;
+    }
+
+    // Неконстантную переменную можно сделать ссылкой, только если тело цикла её не меняет.
+    // Структурные привязки меняются через BindingDecl, которые анализатор для самой переменной не видит.
+    const bool is_const = var_type.isConstQualified();
+    if (!is_const && isa<DecompositionDecl>(LoopVar)) {
+        return;
+    }
+    if (!is_const && ExprMutationAnalyzer(*Loop->getBody(), Context).isMutated(LoopVar)) {
+        return;
+    }
+
+    // for (std::pair<K, V> p : map) копирует элемент std::pair<const K, V> с преобразованием:
+    // const& на объявленный тип привяжется к временному объекту, поэтому тип заменяется на auto.
+    QualType element = elementType(LoopVar);
+    if (!element.isNull() && isStdPair(var_type) && isStdPair(element) &&
+        !Context.hasSameUnqualifiedType(var_type, element)) {
+        if (!replaceText(SourceRange(LoopVar->getBeginLoc(), type_end), "const auto&", SM, Context.getLangOpts())) {
             return;
         }
+        report(Diag, SM, LoopVar->getLocation(),
+               "range-based for loop copies and converts a std::pair element; replaced the type with 'const auto&'");
+        return;
+    }
 
-        SourceLocation loc = type_loc.getEndLoc();
-        if (!loc.isValid()) {
+    if (!is_const && !insertText(LoopVar->getBeginLoc(), "const ", SM)) {
+        return;
+    }
+    if (!insertTextAfterToken(type_end, "&", SM, Context.getLangOpts())) {
+        return;
+    }
+    report(Diag, SM, LoopVar->getLocation(),
+           is_const ? "range-based for loop uses copying; added '&'"
+                    : "range-based for loop copies a variable that is never modified; added 'const' and '&'");
+}
+
+namespace {
+bool isStdMoveDeclared(ASTContext &Context) {
+    auto declares_move = [&](const DeclContext *Namespace) {
+        for (const NamedDecl *decl : Namespace->lookup(&Context.Idents.get("move"))) {
+            if (isa<FunctionTemplateDecl>(decl)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // libc++ объявляет всё во вложенном inline namespace std::__1.
+    for (const NamedDecl *decl : Context.getTranslationUnitDecl()->lookup(&Context.Idents.get("std"))) {
+        const auto *std_namespace = dyn_cast<NamespaceDecl>(decl);
+        if (!std_namespace) {
+            continue;
+        }
+        if (declares_move(std_namespace)) {
+            return true;
+        }
+        for (const Decl *inner : std_namespace->decls()) {
+            const auto *inline_namespace = dyn_cast<NamespaceDecl>(inner);
+            if (inline_namespace && inline_namespace->isInline() && declares_move(inline_namespace)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+const DeclRefExpr *asParamRef(const Expr *E, const ParmVarDecl *Param) {
+    const auto *ref = E ? dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()) : nullptr;
+    return ref && ref->getDecl() == Param ? ref : nullptr;
+}
+
+// Единственное использование параметра - копия в поле класса: name_(param) в списке инициализации
+// или name_ = param; на верхнем уровне тела. Возвращает это использование.
+const DeclRefExpr *findMemberSink(const FunctionDecl *Function, const ParmVarDecl *Param) {
+    if (const auto *ctor = dyn_cast<CXXConstructorDecl>(Function)) {
+        for (const CXXCtorInitializer *init : ctor->inits()) {
+            if (!init->isAnyMemberInitializer() || !init->isWritten()) {
+                continue;
+            }
+            const auto *construct = dyn_cast<CXXConstructExpr>(init->getInit()->IgnoreImplicit());
+            if (construct && construct->getNumArgs() == 1 && construct->getConstructor()->isCopyConstructor()) {
+                if (const DeclRefExpr *ref = asParamRef(construct->getArg(0), Param)) {
+                    return ref;
+                }
+            }
+        }
+    }
+
+    const auto *body = dyn_cast_or_null<CompoundStmt>(Function->getBody());
+    if (!body || !isa<CXXMethodDecl>(Function)) {
+        return nullptr;
+    }
+    for (const Stmt *stmt : body->body()) {
+        const auto *expr = dyn_cast<Expr>(stmt);
+        const auto *call = expr ? dyn_cast<CXXOperatorCallExpr>(expr->IgnoreImplicit()) : nullptr;
+        if (!call || call->getOperator() != OO_Equal || call->getNumArgs() != 2) {
+            continue;
+        }
+        const auto *method = dyn_cast_or_null<CXXMethodDecl>(call->getDirectCallee());
+        const auto *member = dyn_cast<MemberExpr>(call->getArg(0)->IgnoreParenImpCasts());
+        if (method && method->isCopyAssignmentOperator() && member &&
+            isa<CXXThisExpr>(member->getBase()->IgnoreParenImpCasts())) {
+            if (const DeclRefExpr *ref = asParamRef(call->getArg(1), Param)) {
+                return ref;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool isMutatedIn(const FunctionDecl *Function, const ParmVarDecl *Param, ASTContext &Context) {
+    if (ExprMutationAnalyzer(*Function->getBody(), Context).isMutated(Param)) {
+        return true;
+    }
+    if (const auto *ctor = dyn_cast<CXXConstructorDecl>(Function)) {
+        for (const CXXCtorInitializer *init : ctor->inits()) {
+            if (init->getInit() && ExprMutationAnalyzer(*init->getInit(), Context).isMutated(Param)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// return param; перемещает параметр по значению, а из const T& пришлось бы копировать.
+bool isReturned(const FunctionDecl *Function, const ParmVarDecl *Param, ASTContext &Context) {
+    auto param_ref = declRefExpr(to(equalsNode(Param)));
+    auto returned = returnStmt(hasReturnValue(
+        ignoringImplicit(anyOf(param_ref, cxxConstructExpr(hasArgument(0, ignoringImplicit(param_ref)))))));
+    return !match(findAll(returned), *Function->getBody(), Context).empty();
+}
+
+// Ссылка вместо значения меняет семантику для некопируемых типов (unique_ptr и т.п.):
+// владение перестаёт передаваться. Неявный конструктор копирования Sema объявляет лениво,
+// поэтому для классов без объявленного считаем его удалённым, если некопируем какой-то подобъект.
+bool isCopyable(QualType Type) {
+    const CXXRecordDecl *record = Type->getBaseElementTypeUnsafe()->getAsCXXRecordDecl();
+    if (!record || !record->hasDefinition()) {
+        return true;
+    }
+    record = record->getDefinition();
+
+    bool declared = false;
+    for (const CXXConstructorDecl *ctor : record->ctors()) {
+        if (ctor->isCopyConstructor()) {
+            declared = true;
+            if (!ctor->isDeleted()) {
+                return true;
+            }
+        }
+    }
+    if (declared || record->hasUserDeclaredMoveConstructor() || record->hasUserDeclaredMoveAssignment()) {
+        return false;
+    }
+
+    for (const CXXBaseSpecifier &base : record->bases()) {
+        if (!isCopyable(base.getType())) {
+            return false;
+        }
+    }
+    for (const FieldDecl *field : record->fields()) {
+        if (!field->getType()->isReferenceType() && !isCopyable(field->getType())) {
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+void RefactorHandler::handle_value_param(const FunctionDecl *Function, DiagnosticsEngine &Diag, SourceManager &SM,
+                                         ASTContext &Context) {
+    if (!Function->hasBody() || !isRefactorable(Function->getLocation(), SM)) {
+        return;
+    }
+    // Параметры корутины копируются в её кадр и должны жить дольше вызова.
+    if (isa<CoroutineBodyStmt>(Function->getBody())) {
+        return;
+    }
+    const auto *method = dyn_cast<CXXMethodDecl>(Function);
+
+    for (unsigned i = 0; i < Function->getNumParams(); ++i) {
+        // Исправление каждого параметра фиксируется отдельно: части, от которых отказались, не переходят дальше.
+        StagedEdits.clear();
+        const ParmVarDecl *param = Function->getParamDecl(i);
+        QualType type = param->getType();
+        if (type->isReferenceType() || type->isDependentType() || type->isIncompleteType() ||
+            !isExpensiveToCopy(type, Context) || !isCopyable(type)) {
+            continue;
+        }
+        // operator=(T other) - идиома copy-and-swap, а T(T other) вообще не конструктор копирования.
+        if (method && Context.hasSameUnqualifiedType(type, Context.getRecordType(method->getParent()))) {
+            continue;
+        }
+
+        // Параметр только копируется в поле: вместо копии переносим его, сигнатура не меняется.
+        if (!type.isConstQualified() && isStdMoveDeclared(Context)) {
+            auto refs = match(decl(forEachDescendant(declRefExpr(to(equalsNode(param))).bind("ref"))), *Function,
+                              Context);
+            const DeclRefExpr *sink = refs.size() == 1 ? findMemberSink(Function, param) : nullptr;
+            if (sink && isRefactorable(sink->getBeginLoc(), SM) && !sink->getBeginLoc().isMacroID() &&
+                !sink->getEndLoc().isMacroID()) {
+                if (insertText(sink->getBeginLoc(), "std::move(", SM) &&
+                    insertTextAfterToken(sink->getEndLoc(), ")", SM, Context.getLangOpts())) {
+                    report(Diag, SM, sink->getBeginLoc(),
+                           "parameter passed by value is copied into a member; wrapped in std::move");
+                }
+                continue;
+            }
+        }
+
+        if (isMutatedIn(Function, param, Context) || isReturned(Function, param, Context)) {
+            continue;
+        }
+        if (!makeConstRefParam(Function, i, SM, Context.getLangOpts())) {
+            continue;
+        }
+        report(Diag, SM, param->getLocation(),
+               type.isConstQualified()
+                   ? "expensive parameter is passed by value but never modified; added '&'"
+                   : "expensive parameter is passed by value but never modified; added 'const' and '&'");
+    }
+}
+
+namespace {
+std::optional<std::string> sourceText(const Expr *E, const SourceManager &SM, const LangOptions &LangOpts) {
+    if (E->getBeginLoc().isMacroID() || E->getEndLoc().isMacroID()) {
+        return std::nullopt;
+    }
+    StringRef text = Lexer::getSourceText(CharSourceRange::getTokenRange(E->getSourceRange()), SM, LangOpts);
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    return text.str();
+}
+
+bool isDeclRefTo(const Expr *E, const ValueDecl *D) {
+    const auto *ref = dyn_cast_or_null<DeclRefExpr>(E ? E->IgnoreParenImpCasts() : nullptr);
+    return ref && ref->getDecl() == D;
+}
+
+// Выражение без побочных эффектов, которое можно повторить перед циклом: x, obj.x, this->x, p->x.
+bool isStableRef(const Expr *E) {
+    E = E->IgnoreParenImpCasts();
+    if (isa<DeclRefExpr>(E) || isa<CXXThisExpr>(E)) {
+        return true;
+    }
+    if (const auto *member = dyn_cast<MemberExpr>(E)) {
+        return isa<FieldDecl>(member->getMemberDecl()) && isStableRef(member->getBase());
+    }
+    return false;
+}
+
+bool isMutatedInLoop(const Stmt *Body, const Expr *E, ASTContext &Context) {
+    const auto *ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    return !ref || ExprMutationAnalyzer(*Body, Context).isMutated(ref->getDecl());
+}
+
+// Число итераций range-for: размер массива или size() стандартного контейнера.
+std::optional<std::string> tripCount(const CXXForRangeStmt *Loop, const SourceManager &SM, ASTContext &Context) {
+    const Expr *range = Loop->getRangeInit();
+    if (!range || !isStableRef(range)) {
+        return std::nullopt;
+    }
+    QualType type = range->getType();
+    if (const auto *array = Context.getAsConstantArrayType(type)) {
+        return std::to_string(array->getSize().getZExtValue());
+    }
+    const auto *record = type->getAsCXXRecordDecl();
+    if (!record || !record->isInStdNamespace() || record->lookup(&Context.Idents.get("size")).empty()) {
+        return std::nullopt;
+    }
+    auto text = sourceText(range, SM, Context.getLangOpts());
+    return text ? std::optional<std::string>(*text + ".size()") : std::nullopt;
+}
+
+// Число итераций счётного цикла for (T i = 0; i < n; ++i), если i и n в теле не меняются.
+// n - size(), беззнаковая переменная или литерал.
+std::optional<std::string> tripCount(const ForStmt *Loop, const SourceManager &SM, ASTContext &Context) {
+    const auto *init = dyn_cast_or_null<DeclStmt>(Loop->getInit());
+    const auto *counter = init && init->isSingleDecl() ? dyn_cast<VarDecl>(init->getSingleDecl()) : nullptr;
+    if (!counter || !counter->getInit()) {
+        return std::nullopt;
+    }
+    const auto *start = dyn_cast<IntegerLiteral>(counter->getInit()->IgnoreParenImpCasts());
+    if (!start || start->getValue() != 0) {
+        return std::nullopt;
+    }
+
+    const auto *cond = dyn_cast_or_null<BinaryOperator>(Loop->getCond());
+    if (!cond || (cond->getOpcode() != BO_LT && cond->getOpcode() != BO_NE) || !isDeclRefTo(cond->getLHS(), counter)) {
+        return std::nullopt;
+    }
+    const auto *inc = dyn_cast_or_null<UnaryOperator>(Loop->getInc());
+    if (!inc || !inc->isIncrementOp() || !isDeclRefTo(inc->getSubExpr(), counter)) {
+        return std::nullopt;
+    }
+
+    const Stmt *body = Loop->getBody();
+    if (ExprMutationAnalyzer(*body, Context).isMutated(counter)) {
+        return std::nullopt;
+    }
+    const Expr *bound = cond->getRHS()->IgnoreParenImpCasts();
+    if (const auto *size = dyn_cast<CXXMemberCallExpr>(bound)) {
+        const CXXMethodDecl *method = size->getMethodDecl();
+        if (!method || method->getName() != "size" || size->getNumArgs() != 0 ||
+            !isStableRef(size->getImplicitObjectArgument()) ||
+            isMutatedInLoop(body, size->getImplicitObjectArgument(), Context)) {
+            return std::nullopt;
+        }
+    } else if (const auto *ref = dyn_cast<DeclRefExpr>(bound)) {
+        // Знаковая граница может оказаться отрицательной, и reserve(n) бросит length_error.
+        if (!ref->getType()->isUnsignedIntegerType() || isMutatedInLoop(body, bound, Context)) {
+            return std::nullopt;
+        }
+    } else if (!isa<IntegerLiteral>(bound)) {  // Литерал неотрицателен: минус - отдельный UnaryOperator.
+        return std::nullopt;
+    }
+    return sourceText(bound, SM, Context.getLangOpts());
+}
+
+unsigned countRefs(const Stmt &Root, const VarDecl *Var, ASTContext &Context) {
+    return match(findAll(declRefExpr(to(equalsNode(Var)))), Root, Context).size();
+}
+}  // namespace
+
+void RefactorHandler::handle_reserve(const Stmt *Loop, const VarDecl *Container, const Expr *Push,
+                                     DiagnosticsEngine &Diag, SourceManager &SM, ASTContext &Context) {
+    SourceLocation loc = Loop->getBeginLoc();
+    if (loc.isMacroID() || !isRefactorable(loc, SM)) {
+        return;
+    }
+
+    // break/return/goto делают число итераций неизвестным.
+    if (!match(findAll(stmt(anyOf(breakStmt(), returnStmt(), gotoStmt()))), *Loop, Context).empty()) {
+        return;
+    }
+    std::optional<std::string> count;
+    if (const auto *range_for = dyn_cast<CXXForRangeStmt>(Loop)) {
+        count = tripCount(range_for, SM, Context);
+    } else if (const auto *for_stmt = dyn_cast<ForStmt>(Loop)) {
+        count = tripCount(for_stmt, SM, Context);
+    }
+    if (!count) {
+        return;
+    }
+
+    // В цикле контейнер только растёт на один элемент за итерацию.
+    if (countRefs(*Loop, Container, Context) != 1) {
+        return;
+    }
+
+    // Контейнер объявлен пустым в том же блоке, что и цикл, и до цикла не используется:
+    // тогда reserve(n) - ровно нужная ёмкость, а не повторный reserve во внешнем цикле.
+    const Expr *init = Container->getInit() ? Container->getInit()->IgnoreImplicit() : nullptr;
+    const auto *construct = dyn_cast_or_null<CXXConstructExpr>(init);
+    if (!construct || !llvm::all_of(construct->arguments(), [](const Expr *arg) {
+            return isa<CXXDefaultArgExpr>(arg);
+        })) {
+        return;
+    }
+    auto parents = Context.getParents(*Loop);
+    const auto *block = parents.empty() ? nullptr : parents[0].get<CompoundStmt>();
+    if (!block) {
+        return;
+    }
+    bool declared = false;
+    for (const Stmt *stmt : block->body()) {
+        if (stmt == Loop) {
+            break;
+        }
+        if (const auto *decl_stmt = dyn_cast<DeclStmt>(stmt);
+            decl_stmt && llvm::is_contained(decl_stmt->decls(), static_cast<const Decl *>(Container))) {
+            declared = true;
+            continue;
+        }
+        if (declared && countRefs(*stmt, Container, Context) != 0) {
             return;
         }
+    }
+    if (!declared) {
+        return;
+    }
+
+    const std::string call = Container->getName().str() + ".reserve(" + *count + ")";
+    const std::string indent = Lexer::getIndentationForLine(loc, SM).str();
+    if (!insertText(loc, call + ";\n" + indent, SM)) {
+        return;
+    }
+    report(Diag, SM, loc,
+           "loop grows '" + Container->getName().str() + "' one element per iteration; added '" + call + "'");
+}
+
+bool RefactorHandler::makeConstRefParam(const FunctionDecl *Function, unsigned Index, const SourceManager &SM,
+                                        const LangOptions &LangOpts) {
+    // Сигнатуру нельзя менять у функций, на которые ссылаются не только вызовами, у виртуальных
+    // (её разделяют переопределения) и у extern "C".
+    const auto *method = dyn_cast<CXXMethodDecl>(Function);
+    if ((method && method->isVirtual()) || Function->isExternC() || AddressTaken.isAddressTaken(Function)) {
+        return false;
+    }
+
+    // Сначала проверяем все объявления, чтобы не оставить их рассогласованными.
+    llvm::SmallVector<std::pair<const ParmVarDecl *, TypeLoc>, 2> params;
+    for (const FunctionDecl *decl : Function->redecls()) {
+        if (Index >= decl->getNumParams()) {
+            return false;
+        }
+        const ParmVarDecl *param = decl->getParamDecl(Index);
+        const TypeSourceInfo *type_info = param->getTypeSourceInfo();
+        if (!type_info || type_info->getTypeLoc().isNull()) {
+            return false;
+        }
+        TypeLoc type_loc = type_info->getTypeLoc();
+        if (type_loc.getBeginLoc().isInvalid() || type_loc.getBeginLoc().isMacroID() ||
+            type_loc.getEndLoc().isMacroID() || !isRefactorable(type_loc.getBeginLoc(), SM)) {
+            return false;
+        }
+        params.emplace_back(param, type_loc);
+    }
+
+    // Повторная правка того же объявления (из другой TU или другого совпадения) - не ошибка:
+    // commitEdits пропустит уже сделанные части, а остальные зафиксирует вместе.
+    for (const auto &[param, type_loc] : params) {
+        if (!param->getType().isConstQualified() && !insertText(type_loc.getBeginLoc(), "const ", SM)) {
+            return false;
+        }
+        if (!insertTextAfterToken(type_loc.getEndLoc(), "&", SM, LangOpts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RefactorHandler::isRefactorable(SourceLocation Loc, const SourceManager &SM) {
+    if (SM.isInMainFile(Loc)) {
+        return true;
+    }
+    if (!HeaderFilter || Loc.isInvalid() || SM.isInSystemHeader(Loc)) {
+        return false;
+    }
+
+    FileID file = SM.getFileID(SM.getExpansionLoc(Loc));
+    auto [it, inserted] = RefactorableFiles.try_emplace(file, false);
+    if (inserted) {
+        if (auto entry = SM.getFileEntryRefForID(file)) {
+            it->second = HeaderFilter->match(entry->getName());
+        }
+    }
+    return it->second;
+}
+
+void RefactorHandler::report(DiagnosticsEngine &Diag, const SourceManager &SM, SourceLocation Loc,
+                             StringRef Message) {
+    std::vector<StagedEdit> committed = commitEdits();
+    if (committed.empty()) {
+        return;
+    }
+
+    const unsigned DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Warning, "%0");
+    {
+        DiagnosticBuilder builder = Diag.Report(Loc, DiagID);
+        builder << Message;
+        if (EmitFixIts) {
+            for (const StagedEdit &part : committed) {
+                builder << part.FixIt;
+            }
+        }
+    }
+    ++Output.Stats.Edits[CurrentCheck];
 
-        Rewrite.InsertTextAfterToken(loc, "&");
-        const unsigned DiagID =
-            Diag.getCustomDiagID(DiagnosticsEngine::Warning, "range-based for loop uses copying; added '&'");
-        Diag.Report(LoopVar->getLocation(), DiagID);
+    PresumedLoc presumed = SM.getPresumedLoc(Loc);
+    if (presumed.isValid()) {
+        Output.Warnings.push_back(llvm::formatv("{0}:{1}:{2}: warning: {3}", presumed.getFilename(),
+                                                presumed.getLine(), presumed.getColumn(), Message)
+                                      .str());
+
+        llvm::SmallString<256> path(presumed.getFilename());
+        SM.getFileManager().makeAbsolutePath(path);
+        llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+        std::vector<Replacement> edits;
+        for (StagedEdit &part : committed) {
+            edits.push_back(std::move(part.Edit));
+        }
+        Output.Findings.push_back({CurrentCheck, std::string(path.str()), presumed.getLine(), presumed.getColumn(),
+                                   Message.str(), std::move(edits)});
     }
 }
 
+std::vector<RefactorHandler::StagedEdit> RefactorHandler::commitEdits() {
+    std::vector<StagedEdit> staged = std::move(StagedEdits);
+    StagedEdits.clear();
+
+    // Части, уже сделанные этой TU (то же место нашлось повторно), не новые.
+    llvm::erase_if(staged, [&](const StagedEdit &part) { return AppliedEdits.count(part.Edit) != 0; });
+    if (staged.empty()) {
+        return {};
+    }
+
+    // Все части проверяются на копиях до того, как хоть одна попадёт в Output или Collector:
+    // половина исправления (например, "std::move(" без ")") сломала бы код.
+    FileReplacements checked;
+    for (const StagedEdit &part : staged) {
+        const std::string path(part.Edit.getFilePath());
+        auto [it, inserted] = checked.try_emplace(path);
+        if (inserted) {
+            if (auto found = Output.Replaces.find(path); found != Output.Replaces.end()) {
+                it->second = found->second;
+            }
+        }
+        if (auto err = it->second.add(part.Edit)) {
+            llvm::errs() << "Skipping conflicting fix: " << llvm::toString(std::move(err)) << "\n";
+            return {};
+        }
+    }
+
+    for (const StagedEdit &part : staged) {
+        AppliedEdits.insert(part.Edit);
+    }
+    // Части в общем заголовке уже могла сделать другая TU - тогда не дублируем ни их, ни диагностику.
+    if (Collector) {
+        std::vector<Replacement> parts;
+        for (const StagedEdit &part : staged) {
+            parts.push_back(part.Edit);
+        }
+        const std::vector<bool> fresh = Collector->claim(parts);
+        size_t kept = 0;
+        for (size_t i = 0; i < staged.size(); ++i) {
+            if (fresh[i]) {
+                staged[kept++] = std::move(staged[i]);
+            }
+        }
+        staged.resize(kept);
+    }
+
+    // Подмножество проверенных частей заведомо не конфликтует.
+    for (const StagedEdit &part : staged) {
+        llvm::cantFail(Output.Replaces[std::string(part.Edit.getFilePath())].add(part.Edit));
+    }
+    return staged;
+}
+
+bool RefactorHandler::insertText(SourceLocation Loc, StringRef Text, const SourceManager &SM) {
+    return addEdit(Loc, 0, Text, SM);
+}
+
+bool RefactorHandler::replaceText(SourceRange Range, StringRef Text, const SourceManager &SM,
+                                  const LangOptions &LangOpts) {
+    if (Range.getBegin().isMacroID() || Range.getEnd().isMacroID()) {
+        return false;
+    }
+    SourceLocation end = Lexer::getLocForEndOfToken(Range.getEnd(), 0, SM, LangOpts);
+    if (end.isInvalid() || !SM.isWrittenInSameFile(Range.getBegin(), end)) {
+        return false;
+    }
+    return addEdit(Range.getBegin(), SM.getFileOffset(end) - SM.getFileOffset(Range.getBegin()), Text, SM);
+}
+
+bool RefactorHandler::addEdit(SourceLocation Loc, unsigned Length, StringRef Text, const SourceManager &SM) {
+    if (Loc.isInvalid() || Loc.isMacroID()) {
+        return false;
+    }
+
+    Replacement edit(SM, Loc, Length, Text);
+    if (!edit.isApplicable()) {
+        return false;
+    }
+
+    // Путь делаем абсолютным: ClangTool меняет рабочий каталог под каждую команду компиляции,
+    // а правки применяются уже после обработки всех TU.
+    llvm::SmallString<256> path(edit.getFilePath());
+    SM.getFileManager().makeAbsolutePath(path);
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+    Replacement abs_edit(path, edit.getOffset(), Length, Text);
+
+    FixItHint fix;
+    if (EmitFixIts) {
+        fix = Length == 0 ? FixItHint::CreateInsertion(Loc, Text)
+                          : FixItHint::CreateReplacement(
+                                CharSourceRange::getCharRange(Loc, Loc.getLocWithOffset(Length)), Text);
+    }
+    StagedEdits.push_back({std::move(abs_edit), std::move(fix)});
+    return true;
+}
+
+bool RefactorHandler::insertTextAfterToken(SourceLocation Loc, StringRef Text, const SourceManager &SM,
+                                           const LangOptions &LangOpts) {
+    return insertText(Lexer::getLocForEndOfToken(Loc, 0, SM, LangOpts), Text, SM);
+}
+
 auto NvDtorMatcher() { return cxxDestructorDecl(unless(isVirtual()), unless(isImplicit())).bind("classDecl"); }
 
 auto NoOverrideMatcher() {
     return cxxMethodDecl(isOverride(), unless(hasAttr(attr::Override)), unless(cxxDestructorDecl())).bind("methodDecl");
 }
 
-// Конструктор принимает Rewriter для изменения кода.
-auto NoRefConstVarInRangeLoopMatcher() { return cxxForRangeStmt(hasLoopVariable(varDecl().bind("loopVar"))); }
+// Инстанцирования шаблонов пропускаем: правка в шаблоне зависела бы от конкретного аргумента.
+auto NoRefConstVarInRangeLoopMatcher() {
+    return cxxForRangeStmt(unless(isInTemplateInstantiation()), hasLoopVariable(varDecl().bind("loopVar")))
+        .bind("loop");
+}
+
+auto ValueParamMatcher() {
+    return functionDecl(isDefinition(), unless(isImplicit()), unless(isDeleted()), unless(isDefaulted()),
+                        unless(isInstantiated()), unless(isMain()),
+                        unless(cxxMethodDecl(ofClass(cxxRecordDecl(isLambda())))), hasAnyParameter(parmVarDecl()))
+        .bind("function");
+}
+
+auto LeafClassMatcher() {
+    return cxxRecordDecl(isDefinition(), unless(isImplicit()), unless(isInstantiated()), unless(isLambda()),
+                         unless(hasAttr(attr::Final)))
+        .bind("leafClass");
+}
+
+// push_back/emplace_back в локальный std::vector/std::string безусловно, прямо в теле цикла.
+auto GrowingLoopMatcher() {
+    auto container = varDecl(hasLocalStorage(), unless(parmVarDecl())).bind("container");
+    auto push = cxxMemberCallExpr(callee(cxxMethodDecl(hasAnyName("push_back", "emplace_back"),
+                                                       ofClass(hasAnyName("::std::vector", "::std::basic_string")))),
+                                  on(declRefExpr(to(container))))
+                    .bind("push");
+    auto body = anyOf(expr(ignoringImplicit(push)), compoundStmt(has(expr(ignoringImplicit(push)))));
+    return stmt(unless(isInTemplateInstantiation()), anyOf(forStmt(hasBody(body)), cxxForRangeStmt(hasBody(body))))
+        .bind("loop");
+}
 
-ComplexConsumer::ComplexConsumer(Rewriter &Rewrite) : Handler(Rewrite) {
-    Finder.addMatcher(NvDtorMatcher(), &Handler);
-    Finder.addMatcher(NoOverrideMatcher(), &Handler);
-    Finder.addMatcher(NoRefConstVarInRangeLoopMatcher(), &Handler);
+ComplexConsumer::ComplexConsumer(TranslationUnitResult &Output, const RefactorOptions &Options,
+                                 ReplacementsCollector *Collector)
+    : Options(Options), Stats(Output.Stats), Handler(Output, Hierarchy, AddressTaken, Options, Collector) {
+    // Выключенные проверки не регистрируются, и MatchFinder не тратит на них время при обходе.
+    if (Options.isEnabled(Check::NvDtor)) {
+        Finder.addMatcher(NvDtorMatcher(), &NvDtorCallback);
+    }
+    if (Options.isEnabled(Check::Override)) {
+        Finder.addMatcher(NoOverrideMatcher(), &OverrideCallback);
+    }
+    if (Options.isEnabled(Check::RangeFor)) {
+        Finder.addMatcher(NoRefConstVarInRangeLoopMatcher(), &RangeForCallback);
+    }
+    if (Options.isEnabled(Check::ValueParam)) {
+        Finder.addMatcher(ValueParamMatcher(), &ValueParamCallback);
+    }
+    if (Options.isEnabled(Check::Reserve)) {
+        Finder.addMatcher(GrowingLoopMatcher(), &ReserveCallback);
+    }
+    // Без иерархии всей программы лист определить нельзя: наследник может быть в другой TU.
+    if (Options.isEnabled(Check::Final) && Options.Program) {
+        Finder.addMatcher(LeafClassMatcher(), &FinalCallback);
+    }
+}
+
+bool ComplexConsumer::shouldSkipFunctionBody(Decl *D) {
+    if (!(Options.EnabledChecks & BodyChecks)) {
+        return true;
+    }
+    return !Handler.isRefactorable(D->getLocation(), D->getASTContext().getSourceManager());
 }
 
 // Метод HandleTranslationUnit вызывается для каждого файла.
-void ComplexConsumer::HandleTranslationUnit(ASTContext &Context) { Finder.matchAST(Context); }
+// Индекс иерархии строится один раз до запуска матчеров.
+void ComplexConsumer::HandleTranslationUnit(ASTContext &Context) {
+    Stats.ParseMs = elapsedMs(Stats.Started);
+
+    if (Options.isEnabled(Check::NvDtor)) {
+        llvm::TimeTraceScope scope("HierarchyIndex");
+        const auto started = std::chrono::steady_clock::now();
+        Hierarchy.build(Context);
+        Stats.IndexMs += elapsedMs(started);
+    }
+    if (Options.isEnabled(Check::ValueParam)) {
+        llvm::TimeTraceScope scope("AddressTakenIndex");
+        const auto started = std::chrono::steady_clock::now();
+        AddressTaken.build(Context);
+        Stats.IndexMs += elapsedMs(started);
+    }
+
+    llvm::TimeTraceScope scope("MatchAST");
+    const auto started = std::chrono::steady_clock::now();
+    Finder.matchAST(Context);
+    Stats.MatchMs = elapsedMs(started);
 
-std::unique_ptr<ASTConsumer> CodeRefactorAction::CreateASTConsumer(CompilerInstance &CI, StringRef file) {
-    RewriterForCodeRefactor.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-    return std::make_unique<ComplexConsumer>(RewriterForCodeRefactor);
+    // Индексы держат указатели в AST, который сейчас будет освобождён; не тянем их до конца действия.
+    Hierarchy.clear();
+    AddressTaken.clear();
 }
 
-bool CodeRefactorAction::BeginSourceFileAction(CompilerInstance &CI) {
-    // Инициализируем Rewriter для рефакторинга.
-    RewriterForCodeRefactor.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-    return true;  // Возвращаем true, чтобы продолжить обработку файла.
+void ReplacementsCollector::add(const FileReplacements &Replaces) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    for (const auto &[path, replaces] : Replaces) {
+        std::set<StoredEdit> &stored = Edits[path];
+        for (const Replacement &edit : replaces) {
+            stored.emplace(edit);
+        }
+        // Правки TU уже прошли claim, поэтому каждая из них новая для прогона.
+        if (FixesOut) {
+            for (const Replacement &edit : replaces) {
+                writeYAML(edit);
+            }
+        }
+    }
+    if (FixesOut) {
+        FixesOut->flush();
+    }
 }
 
-void CodeRefactorAction::EndSourceFileAction() {
-    // Применяем изменения в файле.
-    if (RewriterForCodeRefactor.overwriteChangedFiles()) {
-        llvm::errs() << "Error applying changes to files.\n";
+size_t ReplacementsCollector::pendingEdits() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    size_t count = 0;
+    for (const auto &[path, edits] : Edits) {
+        count += edits.size();
     }
+    return count;
 }
 
-int main(int argc, const char **argv) {
-    // Парсер опций: Обрабатывает флаги командной строки, компиляционные базы данных.
-    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory);
-    if (!ExpectedParser) {
-        llvm::errs() << ExpectedParser.takeError();
-        return 1;
+std::vector<std::string> ReplacementsCollector::editedFiles() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::vector<std::string> files;
+    for (const auto &[path, edits] : Edits) {
+        files.push_back(path);
     }
-    CommonOptionsParser &OptionsParser = ExpectedParser.get();
-    // Создаем ClangTool
-    ClangTool Tool(OptionsParser.getCompilations(), OptionsParser.getSourcePathList());
-    // Запускаем RefactorAction.
-    return Tool.run(newFrontendActionFactory<CodeRefactorAction>().get());
-}
\ No newline at end of file
+    return files;
+}
+
+void ReplacementsCollector::recordSource(StringRef Path, uint64_t Hash) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    SourceHashes.try_emplace(Path.str(), Hash);
+}
+
+std::vector<bool> ReplacementsCollector::claim(llvm::ArrayRef<Replacement> Parts) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::vector<bool> fresh;
+    fresh.reserve(Parts.size());
+    for (const Replacement &part : Parts) {
+        if (ClaimHashesOnly) {
+            // Совпадение хэшей у разных правок одного файла лишь скрыло бы одну из них в отчёте.
+            const std::string key = std::to_string(part.getOffset()) + ":" + std::to_string(part.getLength()) + ":" +
+                                    part.getReplacementText().str();
+            const uint64_t hash = llvm::xxh3_64bits(llvm::arrayRefFromStringRef(key));
+            fresh.push_back(ClaimHashes[std::string(part.getFilePath())].insert(hash).second);
+        } else {
+            fresh.push_back(Edits[std::string(part.getFilePath())].emplace(part).second);
+        }
+    }
+    return fresh;
+}
+
+namespace {
+// Временный файл создаётся рядом с целевым, чтобы rename не пересекал границу файловых систем.
+bool writeFileAtomically(StringRef Path, StringRef Content) {
+    int fd = -1;
+    llvm::SmallString<256> tmp_path;
+    if (std::error_code ec = llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", fd, tmp_path)) {
+        llvm::errs() << "Error writing " << Path << ": " << ec.message() << "\n";
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << Content;
+        out.close();
+        if (out.has_error()) {
+            llvm::errs() << "Error writing " << Path << ": " << out.error().message() << "\n";
+            out.clear_error();
+            llvm::sys::fs::remove(tmp_path);
+            return false;
+        }
+    }
+    // createUniqueFile создаёт файл с правами 0600; сохраняем права исходника.
+    if (auto perms = llvm::sys::fs::getPermissions(Path)) {
+        llvm::sys::fs::setPermissions(tmp_path, *perms);
+    }
+    if (std::error_code ec = llvm::sys::fs::rename(tmp_path, Path)) {
+        llvm::errs() << "Error writing " << Path << ": " << ec.message() << "\n";
+        llvm::sys::fs::remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+}  // namespace
+
+bool ReplacementsCollector::apply(llvm::function_ref<void(StringRef Path, StringRef Contents)> Written) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    bool ok = true;
+    for (const auto &[path, edits] : Edits) {
+        // Правки упорядочены, поэтому при конфликте детерминированно побеждает первая.
+        Replacements replaces;
+        for (const StoredEdit &edit : edits) {
+            if (auto err = replaces.add(Replacement(path, edit.Offset, edit.Length, edit.Text))) {
+                llvm::errs() << "Skipping conflicting edit in " << path << ": " << llvm::toString(std::move(err))
+                             << "\n";
+            }
+        }
+
+        std::string code;
+        {
+            auto buffer = llvm::MemoryBuffer::getFile(path);
+            if (!buffer) {
+                llvm::errs() << "Error reading " << path << ": " << buffer.getError().message() << "\n";
+                ok = false;
+                continue;
+            }
+            // Смещения правок посчитаны для той версии, что видела TU; по другой они испортили бы файл.
+            auto source = SourceHashes.find(path);
+            if (source != SourceHashes.end() &&
+                llvm::xxh3_64bits(llvm::arrayRefFromStringRef((*buffer)->getBuffer())) != source->second) {
+                llvm::errs() << "Skipping " << path << ": the file changed on disk after it was parsed\n";
+                ok = false;
+                continue;
+            }
+            auto new_code = tooling::applyAllReplacements((*buffer)->getBuffer(), replaces);
+            if (!new_code) {
+                llvm::errs() << "Error applying changes to " << path << ": " << llvm::toString(new_code.takeError())
+                             << "\n";
+                ok = false;
+                continue;
+            }
+            code = std::move(*new_code);
+        }
+
+        if (!writeFileAtomically(path, code)) {
+            ok = false;
+        } else if (Written) {
+            Written(path, code);
+        }
+    }
+    Edits.clear();
+    SourceHashes.clear();
+    return ok;
+}
+
+bool ReplacementsCollector::exportTo(StringRef Path) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::error_code ec;
+    FixesOut = std::make_unique<llvm::raw_fd_ostream>(Path, ec, llvm::sys::fs::OF_Text);
+    if (ec) {
+        llvm::errs() << "Error opening " << Path << ": " << ec.message() << "\n";
+        FixesOut.reset();
+        return false;
+    }
+    *FixesOut << "---\nMainSourceFile:  ''\n";
+    return true;
+}
+
+// YAML пишется вручную, чтобы дописывать правки потоково, не держа весь документ в памяти.
+void ReplacementsCollector::writeYAML(const Replacement &Edit) {
+    if (ExportedCount++ == 0) {
+        *FixesOut << "Replacements:\n";
+    }
+    *FixesOut << "  - FilePath:        \"" << llvm::yaml::escape(Edit.getFilePath(), false) << "\"\n"
+              << "    Offset:          " << Edit.getOffset() << "\n"
+              << "    Length:          " << Edit.getLength() << "\n"
+              << "    ReplacementText: \"" << llvm::yaml::escape(Edit.getReplacementText(), false) << "\"\n";
+}
+
+bool ReplacementsCollector::finishExport() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (!FixesOut) {
+        return false;
+    }
+    if (ExportedCount == 0) {
+        *FixesOut << "Replacements:    []\n";
+    }
+    for (const auto &[path, hash] : SourceHashes) {
+        *FixesOut << "# SourceHash: " << llvm::format_hex_no_prefix(hash, 16) << " " << path << "\n";
+    }
+    *FixesOut << "...\n";
+    FixesOut->close();
+    bool ok = !FixesOut->has_error();
+    if (!ok) {
+        llvm::errs() << "Error writing exported fixes: " << FixesOut->error().message() << "\n";
+        FixesOut->clear_error();
+    }
+    FixesOut.reset();
+    return ok;
+}
+
+bool ReplacementsCollector::importFrom(StringRef Path) {
+    auto buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!buffer) {
+        llvm::errs() << "Error reading " << Path << ": " << buffer.getError().message() << "\n";
+        return false;
+    }
+
+    TranslationUnitReplacements fixes;
+    llvm::yaml::Input yaml((*buffer)->getBuffer());
+    yaml >> fixes;
+    if (yaml.error()) {
+        llvm::errs() << "Error parsing " << Path << ": " << yaml.error().message() << "\n";
+        return false;
+    }
+    claim(fixes.Replacements);
+
+    llvm::SmallVector<StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n');
+    for (StringRef line : lines) {
+        uint64_t hash = 0;
+        if (!line.consume_front("# SourceHash: ") || line.size() < 18 || line.take_front(16).getAsInteger(16, hash)) {
+            continue;
+        }
+        StringRef source = line.drop_front(17);
+        std::lock_guard<std::mutex> lock(Mutex);
+        auto [it, inserted] = SourceHashes.try_emplace(source.str(), hash);
+        if (!inserted && it->second != hash) {
+            llvm::errs() << Path << ": " << source << " was parsed in a different version by another shard\n";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,211 @@
+#include "ResultCache.h"
+#include "clang/Tooling/ReplacementsYaml.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/YAMLTraits.h"
+#include "llvm/Support/xxhash.h"
+#include <chrono>
+#include <set>
+
+using namespace clang::tooling;
+
+// Меняется при любом изменении формата записи или набора проверок - старые записи становятся недостижимы.
+static constexpr const char *CacheFormatVersion = "refactor_tool-cache-4";
+
+namespace {
+struct CachedDependency {
+    std::string Path;
+    llvm::yaml::Hex64 Hash;
+    uint64_t Size = 0;
+    uint64_t ModTime = 0;  // Наносекунды с эпохи; 0 - не доверять, всегда сверять хэш.
+};
+
+struct CachedWarning {
+    std::string Message;
+};
+
+// Хэш исправленного файла, каким его видела TU: при попадании уходит в ReplacementsCollector::recordSource.
+struct CachedSource {
+    std::string Path;
+    llvm::yaml::Hex64 Hash;
+};
+
+struct CachedResult {
+    std::vector<CachedDependency> Dependencies;
+    std::vector<Replacement> Replacements;
+    std::vector<CachedWarning> Warnings;
+    std::vector<CachedSource> Sources;
+};
+
+std::optional<uint64_t> hashFile(llvm::StringRef Path) {
+    auto buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!buffer) {
+        return std::nullopt;
+    }
+    return llvm::xxh3_64bits(llvm::arrayRefFromStringRef((*buffer)->getBuffer()));
+}
+
+uint64_t modificationTime(const llvm::sys::fs::file_status &Status) {
+    return static_cast<uint64_t>(Status.getLastModificationTime().time_since_epoch().count());
+}
+}  // namespace
+
+LLVM_YAML_IS_SEQUENCE_VECTOR(CachedDependency)
+LLVM_YAML_IS_SEQUENCE_VECTOR(CachedWarning)
+LLVM_YAML_IS_SEQUENCE_VECTOR(CachedSource)
+
+namespace llvm::yaml {
+template <>
+struct MappingTraits<CachedDependency> {
+    static void mapping(IO &io, CachedDependency &dependency) {
+        io.mapRequired("Path", dependency.Path);
+        io.mapRequired("Hash", dependency.Hash);
+        io.mapRequired("Size", dependency.Size);
+        io.mapRequired("ModTime", dependency.ModTime);
+    }
+};
+
+template <>
+struct MappingTraits<CachedWarning> {
+    static void mapping(IO &io, CachedWarning &warning) { io.mapRequired("Message", warning.Message); }
+};
+
+template <>
+struct MappingTraits<CachedSource> {
+    static void mapping(IO &io, CachedSource &source) {
+        io.mapRequired("Path", source.Path);
+        io.mapRequired("Hash", source.Hash);
+    }
+};
+
+template <>
+struct MappingTraits<CachedResult> {
+    static void mapping(IO &io, CachedResult &result) {
+        io.mapRequired("Dependencies", result.Dependencies);
+        io.mapRequired("Replacements", result.Replacements);
+        io.mapRequired("Warnings", result.Warnings);
+        io.mapRequired("Sources", result.Sources);
+    }
+};
+}  // namespace llvm::yaml
+
+std::optional<uint64_t> ResultCache::computeKey(const CompilationDatabase &Compilations, llvm::StringRef File,
+                                                const RefactorOptions &Options) {
+    auto content = llvm::MemoryBuffer::getFile(File);
+    if (!content) {
+        return std::nullopt;
+    }
+
+    std::string blob = CacheFormatVersion;
+    blob += '\0';
+    blob += Options.fingerprint();
+    blob += '\0';
+    for (const CompileCommand &command : Compilations.getCompileCommands(File)) {
+        blob += command.Directory;
+        blob += '\0';
+        for (const std::string &arg : command.CommandLine) {
+            blob += arg;
+            blob += '\0';
+        }
+    }
+    blob += (*content)->getBuffer();
+
+    return llvm::xxh3_64bits(llvm::arrayRefFromStringRef(blob));
+}
+
+std::string ResultCache::entryPath(uint64_t Key) const {
+    llvm::SmallString<256> path(Dir);
+    llvm::sys::path::append(path, llvm::utohexstr(Key, /*LowerCase=*/true) + ".yaml");
+    return std::string(path.str());
+}
+
+std::optional<TranslationUnitResult> ResultCache::lookup(uint64_t Key) const {
+    auto buffer = llvm::MemoryBuffer::getFile(entryPath(Key));
+    if (!buffer) {
+        return std::nullopt;
+    }
+
+    CachedResult entry;
+    llvm::yaml::Input yin((*buffer)->getBuffer(), nullptr, [](const llvm::SMDiagnostic &, void *) {});
+    yin >> entry;
+    if (yin.error()) {
+        return std::nullopt;
+    }
+
+    TranslationUnitResult result;
+    for (const CachedDependency &dependency : entry.Dependencies) {
+        // Размер и время изменения прежние - файл не перечитываем. Иначе сверяем хэш: файл могли
+        // лишь тронуть, не меняя содержимого.
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(dependency.Path, status)) {
+            return std::nullopt;
+        }
+        if (dependency.ModTime == 0 || status.getSize() != dependency.Size ||
+            modificationTime(status) != dependency.ModTime) {
+            auto hash = hashFile(dependency.Path);
+            if (!hash || *hash != dependency.Hash) {
+                return std::nullopt;
+            }
+        }
+        result.Dependencies.push_back(dependency.Path);
+    }
+    for (const Replacement &edit : entry.Replacements) {
+        llvm::consumeError(result.Replaces[std::string(edit.getFilePath())].add(edit));
+    }
+    for (const CachedWarning &warning : entry.Warnings) {
+        result.Warnings.push_back(warning.Message);
+    }
+    for (const CachedSource &source : entry.Sources) {
+        result.SourceHashes[source.Path] = source.Hash;
+    }
+    return result;
+}
+
+void ResultCache::store(uint64_t Key, const TranslationUnitResult &Result) const {
+    CachedResult entry;
+    std::set<std::string> dependencies(Result.Dependencies.begin(), Result.Dependencies.end());
+    for (const std::string &dependency : dependencies) {
+        // stat до чтения: если файл изменится между ними, запомненное время не совпадёт с новым
+        // и lookup сверит хэш, а не поверит устаревшему.
+        llvm::sys::fs::file_status status;
+        auto hash = llvm::sys::fs::status(dependency, status) ? std::nullopt : hashFile(dependency);
+        if (!hash) {
+            return;  // Зависимость пропала - надёжную запись сделать нельзя.
+        }
+        // Только что изменённый файл может измениться ещё раз в пределах той же метки времени
+        // (у многих ФС она грубая): для него время не запоминаем.
+        const bool recent =
+            std::chrono::system_clock::now() - status.getLastModificationTime() < std::chrono::seconds(2);
+        entry.Dependencies.push_back(
+            {dependency, llvm::yaml::Hex64(*hash), status.getSize(), recent ? 0 : modificationTime(status)});
+    }
+    for (const auto &[path, replaces] : Result.Replaces) {
+        entry.Replacements.insert(entry.Replacements.end(), replaces.begin(), replaces.end());
+    }
+    for (const std::string &warning : Result.Warnings) {
+        entry.Warnings.push_back({warning});
+    }
+    for (const auto &[path, hash] : Result.SourceHashes) {
+        entry.Sources.push_back({path, llvm::yaml::Hex64(hash)});
+    }
+
+    if (llvm::sys::fs::create_directories(Dir)) {
+        return;
+    }
+
+    int fd = -1;
+    llvm::SmallString<256> tmp_path;
+    if (llvm::sys::fs::createUniqueFile(entryPath(Key) + ".tmp-%%%%%%", fd, tmp_path)) {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        llvm::yaml::Output yout(out);
+        yout << entry;
+    }
+    if (llvm::sys::fs::rename(tmp_path, entryPath(Key))) {
+        llvm::sys::fs::remove(tmp_path);
+    }
+}
@@ -0,0 +1,860 @@
+#include "DryRunReport.h"
+#include "FileWatcher.h"
+#include "LexicalPrefilter.h"
+#include "LocalSocket.h"
+#include "ProgramHierarchy.h"
+#include "RefactorStats.h"
+#include "RefactorTool.h"
+#include "ResultCache.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Командная строка refactor_tool. Проверки, обработчики и применение правок живут в refactor_core.
+
+using namespace clang;
+using namespace clang::tooling;
+
+static llvm::cl::OptionCategory ToolCategory("refactor-tool options");
+
+static llvm::cl::opt<unsigned> Jobs("jobs",
+                                    llvm::cl::desc("Number of translation units processed in parallel "
+                                                   "(0 = all cores). Edits are applied once after all TUs finish"),
+                                    llvm::cl::init(1), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> HeaderFilter(
+    "header-filter",
+    llvm::cl::desc("Regular expression matching the names of headers that may be refactored too. "
+                   "Each header edit is made once per run, however many TUs include the header"),
+    llvm::cl::init(""), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> ExportFixes(
+    "export-fixes",
+    llvm::cl::desc("Do not modify sources; write all edits to the given YAML file instead. "
+                   "The file is consumable by clang-apply-replacements"),
+    llvm::cl::value_desc("filename"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> CacheDir(
+    "cache-dir",
+    llvm::cl::desc("Directory of the persistent result cache (e.g. .refactor_cache). TUs whose sources, "
+                   "includes, flags and options did not change since the last run are not parsed again"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> ReusePreamble(
+    "reuse-preamble",
+    llvm::cl::desc("Precompile the leading #include block once and reuse it for every TU with the same "
+                   "includes and compatible flags"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> Checks("checks",
+                                         llvm::cl::desc("Comma-separated list of checks to run: "
+                                                        "nv-dtor, override, range-for, value-param, reserve, "
+                                                        "final (with --whole-program) or all (default)"),
+                                         llvm::cl::init("all"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> SkipFunctionBodies(
+    "skip-function-bodies",
+    llvm::cl::desc("Do not parse bodies of functions outside the files being refactored, "
+                   "or anywhere at all when no check that looks into bodies is enabled"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<uint64_t> RangeForCopyThreshold(
+    "range-for-copy-threshold",
+    llvm::cl::desc("Size in bytes above which copying a trivially copyable range-for element "
+                   "or by-value parameter is considered expensive (default: 32)"),
+    llvm::cl::init(32), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> PrintStats(
+    "stats",
+    llvm::cl::desc("Print a summary of time spent per phase and per check, match and edit counts, "
+                   "the slowest translation units and peak memory usage"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> TimeTrace(
+    "time-trace",
+    llvm::cl::desc("Write a Chrome trace (chrome://tracing, Perfetto) of the run to the given JSON file, "
+                   "including clang's own parse and Sema events"),
+    llvm::cl::value_desc("filename"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> TimeTraceGranularity(
+    "time-trace-granularity",
+    llvm::cl::desc("Minimum duration of a trace event in microseconds; shorter events are dropped"),
+    llvm::cl::init(500), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> Watch(
+    "watch",
+    llvm::cl::desc("Stay resident: after the first run, wait for changes of the sources and their includes "
+                   "and re-run only the affected translation units (Linux only)"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> FileCache(
+    "file-cache",
+    llvm::cl::desc("Share one in-memory cache of stat results and file contents (memory-mapped) between all "
+                   "translation units of the run, so every header is read from disk once"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> NoPrefilter(
+    "no-prefilter",
+    llvm::cl::desc("Parse every translation unit, even when a lexical pre-scan of the main file shows "
+                   "that it cannot produce any edit"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> WholeProgram(
+    "whole-program",
+    llvm::cl::desc("Parse every translation unit of the compilation database first to collect the complete "
+                   "class hierarchy; enables the 'final' check and lets nv-dtor see subclasses in other "
+                   "translation units"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> DryRun(
+    "dry-run",
+    llvm::cl::desc("Do not modify any file; print what would change in the --format chosen instead. The output "
+                   "of each translation unit is printed as soon as it finishes. --cache-dir is ignored"),
+    llvm::cl::init(false), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<DryRunFormat> Format(
+    "format", llvm::cl::desc("Output format of --dry-run"),
+    llvm::cl::values(clEnumValN(DryRunFormat::Diff, "diff", "Unified diff of every edited file (default)"),
+                     clEnumValN(DryRunFormat::Stats, "stats", "Number of edits per check and per translation unit"),
+                     clEnumValN(DryRunFormat::Sarif, "sarif", "SARIF 2.1.0 log with a fix for every warning")),
+    llvm::cl::init(DryRunFormat::Diff), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> MaxRSS(
+    "max-rss",
+    llvm::cl::desc("Soft limit of the resident memory of the process in MB: while it is exceeded, no new "
+                   "translation unit is started until a running one finishes (0 = no limit)"),
+    llvm::cl::value_desc("MB"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> Shard(
+    "shard",
+    llvm::cl::desc("Process only part I (0 <= I < N) of N deterministic, size-balanced parts of the input files. "
+                   "Use with --export-fixes and combine the outputs with 'refactor_tool merge'"),
+    llvm::cl::value_desc("I/N"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<std::string> Socket(
+    "socket", llvm::cl::desc("Unix domain socket that 'refactor_tool serve' listens on for JSON-RPC requests"),
+    llvm::cl::value_desc("path"), llvm::cl::cat(ToolCategory));
+
+// --max-rss: новая TU начинается, только пока RSS процесса ниже лимита, иначе ждёт завершения другой.
+// Одна TU выполняется всегда, чтобы прогон не встал, даже если лимит меньше потребления одной TU.
+class MemoryGovernor {
+public:
+    explicit MemoryGovernor(size_t LimitBytes) : Limit(LimitBytes) {}
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(Mutex);
+        Finished.wait(lock, [&] { return Running == 0 || RefactorStats::currentRSS() < Limit; });
+        ++Running;
+    }
+
+    void release() {
+#ifdef __GLIBC__
+        // Освобождённая память TU иначе остаётся в куче glibc и RSS не опускается до лимита.
+        malloc_trim(0);
+#endif
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            --Running;
+        }
+        Finished.notify_all();
+    }
+
+private:
+    const size_t Limit;
+    std::mutex Mutex;
+    std::condition_variable Finished;
+    unsigned Running = 0;
+};
+
+// Можно ли не разбирать TU вовсе: в main file нет ни одного кандидата для включённых проверок.
+static bool skippedByPrefilter(const std::string &File, const RefactorOptions &Options) {
+    if (NoPrefilter) {
+        return false;
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(File);
+    return buffer && !mayHaveCandidates((*buffer)->getBuffer(), Options);
+}
+
+// Настройки проверок из командной строки; std::nullopt, если в --checks неизвестная проверка.
+static std::optional<RefactorOptions> makeOptions() {
+    RefactorOptions Options;
+    if (auto checks = parseChecks(Checks)) {
+        Options.EnabledChecks = *checks;
+    } else {
+        llvm::errs() << "Unknown check in --checks=" << Checks << "\n";
+        return std::nullopt;
+    }
+    Options.HeaderFilter = HeaderFilter;
+    Options.SkipFunctionBodies = SkipFunctionBodies;
+    Options.RangeForCopyThreshold = RangeForCopyThreshold;
+    return Options;
+}
+
+// Разбирает "I/N" из --shard.
+static std::optional<std::pair<unsigned, unsigned>> parseShard(llvm::StringRef Spec) {
+    auto [index, count] = Spec.split('/');
+    unsigned i = 0;
+    unsigned n = 0;
+    if (index.getAsInteger(10, i) || count.getAsInteger(10, n) || n == 0 || i >= n) {
+        return std::nullopt;
+    }
+    return std::make_pair(i, n);
+}
+
+// Делит TU между Count шардами жадно по размеру main file: от больших к меньшим, каждая - в наименее
+// загруженный шард. Разбиение зависит только от списка файлов и их размеров, поэтому независимые процессы
+// получают непересекающиеся части, вместе покрывающие весь список. Время TU из кэша результатов для этого
+// не годится: у каждого процесса свой кэш, и шарды разошлись бы в разбиении.
+static std::vector<std::string> selectShard(llvm::ArrayRef<std::string> Files, unsigned Index, unsigned Count) {
+    std::vector<std::pair<uint64_t, size_t>> by_size;  // (размер, номер в Files)
+    for (size_t i = 0; i < Files.size(); ++i) {
+        uint64_t size = 0;
+        llvm::sys::fs::file_size(Files[i], size);
+        by_size.emplace_back(size, i);
+    }
+    std::sort(by_size.begin(), by_size.end(), [&](const auto &A, const auto &B) {
+        if (A.first != B.first) {
+            return A.first > B.first;
+        }
+        return Files[A.second] != Files[B.second] ? Files[A.second] < Files[B.second] : A.second < B.second;
+    });
+
+    std::vector<uint64_t> load(Count, 0);
+    std::vector<std::string> selected;
+    for (const auto &[size, i] : by_size) {
+        const size_t lightest = std::min_element(load.begin(), load.end()) - load.begin();
+        load[lightest] += size + 1;  // Пустой файл тоже стоит запуска TU.
+        if (lightest == Index) {
+            selected.push_back(Files[i]);
+        }
+    }
+    return selected;
+}
+
+// refactor_tool merge a.yaml b.yaml ...: объединяет выгрузки шардов (--shard с --export-fixes),
+// отбрасывает повторы правок общих заголовков и применяет результат к файлам.
+static int runMerge(llvm::ArrayRef<const char *> Args) {
+    if (Args.empty() || llvm::StringRef(Args[0]) == "--help" || llvm::StringRef(Args[0]) == "-h") {
+        llvm::errs() << "USAGE: refactor_tool merge <fixes.yaml>...\n\n"
+                        "Applies the edits exported by several 'refactor_tool --shard=I/N --export-fixes' runs.\n";
+        return Args.empty() ? 1 : 0;
+    }
+
+    ReplacementsCollector Collector;
+    for (const char *Path : Args) {
+        if (!Collector.importFrom(Path)) {
+            return 1;
+        }
+    }
+    return Collector.apply() ? 0 : 1;
+}
+
+// Зависимости каждой TU (абсолютные пути, включая сам main file); заполняются для --watch.
+using DependencyMap = std::map<std::string, std::vector<std::string>>;
+
+// Воспроизводит результат TU из кэша так, как если бы она была разобрана заново.
+static void replayCached(const TranslationUnitResult &Cached, ReplacementsCollector &Collector) {
+    FileReplacements claimed;
+    for (const auto &[path, replaces] : Cached.Replaces) {
+        const std::vector<Replacement> edits(replaces.begin(), replaces.end());
+        const std::vector<bool> fresh = Collector.claim(edits);
+        for (size_t i = 0; i < edits.size(); ++i) {
+            if (fresh[i]) {
+                llvm::consumeError(claimed[path].add(edits[i]));
+            }
+        }
+    }
+    // Хэши нужны apply и --export-fixes, чтобы заметить файл, изменившийся после разбора, как и у разобранной TU.
+    for (const auto &[path, hash] : Cached.SourceHashes) {
+        Collector.recordSource(path, hash);
+    }
+    Collector.add(claimed);
+
+    for (const std::string &warning : Cached.Warnings) {
+        llvm::errs() << warning << "\n";
+    }
+}
+
+// Каждая TU обрабатывается отдельным ClangTool в пуле потоков: свободный поток забирает
+// следующую TU из общей очереди, поэтому тяжёлые файлы не тормозят остальные.
+// У каждого потока свой физический VFS, чтобы ClangTool мог менять рабочий каталог независимо.
+// Если задан SharedPool (serve), задачи идут в него, а не в свой пул на Jobs потоков.
+static int runParallel(const CompilationDatabase &Compilations, llvm::ArrayRef<std::string> Files, unsigned Jobs,
+                       const RefactorOptions &Options, ReplacementsCollector &Collector, const ResultCache *Cache,
+                       PreambleCache *Preambles, SharedFileCache *SharedFiles, RefactorStats *Stats,
+                       DryRunReport *Report = nullptr, DependencyMap *Dependencies = nullptr,
+                       llvm::ThreadPoolInterface *SharedPool = nullptr) {
+    std::atomic<int> Result{0};
+    std::mutex DependenciesMutex;
+    auto recordDependencies = [&](const std::string &File, const TranslationUnitResult &Record) {
+        if (Dependencies) {
+            std::lock_guard<std::mutex> lock(DependenciesMutex);
+            (*Dependencies)[File] = Record.Dependencies;
+        }
+    };
+
+    MemoryGovernor Governor(static_cast<size_t>(MaxRSS) * 1024 * 1024);
+    std::optional<llvm::DefaultThreadPool> OwnPool;
+    if (!SharedPool) {
+        OwnPool.emplace(llvm::hardware_concurrency(Jobs));
+        SharedPool = &*OwnPool;
+    }
+    // Группа ждёт только свои задачи: общий пул в это время может разбирать TU других запросов.
+    llvm::ThreadPoolTaskGroup Pool(*SharedPool);
+    for (const std::string &File : Files) {
+        Pool.async([&, File] {
+            if (MaxRSS) {
+                Governor.acquire();
+            }
+            auto release = llvm::make_scope_exit([&] {
+                if (MaxRSS) {
+                    Governor.release();
+                }
+            });
+
+            // Профилировщик у каждого потока свой; при завершении задачи его события
+            // переносятся в общий список, который пишется в файл из main.
+            if (!TimeTrace.empty()) {
+                llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "refactor_tool");
+            }
+            auto finish_trace = llvm::make_scope_exit([] {
+                if (llvm::timeTraceProfilerEnabled()) {
+                    llvm::timeTraceProfilerFinishThread();
+                }
+            });
+            llvm::TimeTraceScope scope("TranslationUnit", File);
+
+            if (skippedByPrefilter(File, Options)) {
+                if (Stats) {
+                    Stats->addPrefiltered();
+                }
+                // Для --watch: после правки самого файла TU надо проверить заново.
+                TranslationUnitResult record;
+                llvm::SmallString<256> path(File);
+                llvm::sys::fs::make_absolute(path);
+                record.Dependencies.push_back(std::string(path.str()));
+                recordDependencies(File, record);
+                return;
+            }
+
+            std::optional<uint64_t> key;
+            if (Cache) {
+                key = ResultCache::computeKey(Compilations, File, Options);
+                if (key) {
+                    if (auto cached = Cache->lookup(*key)) {
+                        replayCached(*cached, Collector);
+                        recordDependencies(File, *cached);
+                        if (Stats) {
+                            Stats->addCacheHit();
+                        }
+                        return;
+                    }
+                }
+            }
+
+            TranslationUnitResult record;
+            const bool keep_record = key || Dependencies;
+            CodeRefactorActionFactory Factory(Options, &Collector, keep_record ? &record : nullptr);
+            Factory.setPreambleCache(Preambles);
+            Factory.setStats(Stats);
+            Factory.setDryRun(Report);
+            IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs = llvm::vfs::createPhysicalFileSystem();
+            if (SharedFiles) {
+                vfs = SharedFiles->createFileSystem(std::move(vfs));
+            }
+            ClangTool Tool(Compilations, File, std::make_shared<PCHContainerOperations>(), std::move(vfs));
+            int rc = Tool.run(&Factory);
+            // Зависимости нужны и при ошибке: исправленный файл должен перезапустить TU.
+            recordDependencies(File, record);
+            if (rc) {
+                Result = rc;
+            } else if (key) {
+                Cache->store(*key, record);
+            }
+        });
+    }
+    Pool.wait();
+
+    return Result;
+}
+
+// --watch: база компиляции, кэш преамбул и граф зависимостей живут между прогонами,
+// а после каждого изменения заново разбираются только TU, которые включают изменённые файлы.
+// FileManager у каждой TU свой: у него нет точечной инвалидации, а устаревший размер файла
+// после правки дал бы обрезанный буфер. Заголовки из преамбулы при этом повторно не разбираются.
+static int runWatch(const CompilationDatabase &Compilations, llvm::ArrayRef<std::string> Files,
+                    const RefactorOptions &Options, const ResultCache *Cache, SharedFileCache *SharedFiles) {
+    FileWatcher Watcher;
+    if (!Watcher.isValid()) {
+        llvm::errs() << "--watch is not supported on this platform\n";
+        return 1;
+    }
+
+    PreambleCache Preambles;
+    DependencyMap Dependencies;
+    std::vector<std::string> Pending(Files.begin(), Files.end());
+    while (true) {
+        ReplacementsCollector Collector;
+        DependencyMap Updated;
+        const auto started = std::chrono::steady_clock::now();
+        runParallel(Compilations, Pending, Jobs, Options, Collector, Cache, &Preambles, SharedFiles, nullptr, nullptr,
+                    &Updated);
+        Collector.apply([&](llvm::StringRef Path, llvm::StringRef Contents) {
+            if (SharedFiles) {
+                SharedFiles->overlay(Path, Contents);
+            }
+        });
+        llvm::errs() << llvm::formatv("Refactored {0} translation unit(s) in {1:F0} ms; watching for changes\n",
+                                      Pending.size(), elapsedMs(started));
+
+        for (auto &[file, deps] : Updated) {
+            for (const std::string &dep : deps) {
+                Watcher.watch(dep);
+            }
+            Dependencies[file] = std::move(deps);
+        }
+
+        // Свои же правки тоже придут событиями; повторный прогон ничего не изменит и цикл остановится.
+        Pending.clear();
+        while (Pending.empty()) {
+            std::vector<std::string> Changed = Watcher.waitForChanges();
+            if (Changed.empty()) {
+                llvm::errs() << "Error reading file change notifications\n";
+                return 1;
+            }
+            if (SharedFiles) {
+                SharedFiles->invalidate(Changed);
+            }
+
+            for (const auto &[file, deps] : Dependencies) {
+                if (std::any_of(deps.begin(), deps.end(), [&](const std::string &dep) {
+                        return std::binary_search(Changed.begin(), Changed.end(), dep);
+                    })) {
+                    Pending.push_back(file);
+                }
+            }
+        }
+    }
+}
+
+// Состояние refactor_tool serve, которое живёт между запросами: базы компиляции, кэш результатов и преамбулы.
+struct ServerState {
+    RefactorOptions Options;  // Из командной строки serve; запрос может заменить проверки и --header-filter.
+    std::optional<ResultCache> Cache;
+    std::optional<PreambleCache> Preambles;
+    LocalSocketServer &Server;
+    llvm::ThreadPoolInterface &Pool;  // Разбор TU всех запросов, на --jobs потоков.
+
+    std::mutex Mutex;
+    std::map<std::string, std::unique_ptr<CompilationDatabase>> Databases;  // По каталогу сборки.
+
+    // База компиляции каталога сборки; загружается при первом запросе к нему.
+    llvm::Expected<const CompilationDatabase &> database(llvm::StringRef BuildDir) {
+        std::lock_guard<std::mutex> lock(Mutex);
+        auto &database = Databases[BuildDir.str()];
+        if (!database) {
+            std::string error;
+            database = CompilationDatabase::autoDetectFromDirectory(BuildDir, error);
+            if (!database) {
+                Databases.erase(BuildDir.str());
+                return llvm::make_error<llvm::StringError>(error, llvm::inconvertibleErrorCode());
+            }
+        }
+        return *database;
+    }
+
+    // Ждёт, пока ни один из Paths не переписывает другой запрос с apply, и занимает их все разом.
+    void lockFiles(const std::vector<std::string> &Paths) {
+        std::unique_lock<std::mutex> lock(ApplyMutex);
+        ApplyDone.wait(lock, [&] {
+            return std::none_of(Paths.begin(), Paths.end(), [&](const std::string &path) {
+                return Applying.count(path) != 0;
+            });
+        });
+        Applying.insert(Paths.begin(), Paths.end());
+    }
+
+    void unlockFiles(const std::vector<std::string> &Paths) {
+        {
+            std::lock_guard<std::mutex> lock(ApplyMutex);
+            for (const std::string &path : Paths) {
+                Applying.erase(path);
+            }
+        }
+        ApplyDone.notify_all();
+    }
+
+    std::mutex ApplyMutex;
+    std::condition_variable ApplyDone;
+    std::set<std::string> Applying;  // Файлы, которые сейчас пишет Collector::apply какого-нибудь запроса.
+};
+
+// Метод "refactor": params {build_dir, files, checks?, header_filter?, apply?, format?}.
+// С apply правки пишутся на диск, иначе возвращается вывод --dry-run в заданном формате.
+// Относительные пути в files отсчитываются от build_dir.
+static llvm::Expected<llvm::json::Value> handleRefactor(const llvm::json::Object &Params, ServerState &State) {
+    auto BuildDir = Params.getString("build_dir");
+    const llvm::json::Array *FileList = Params.getArray("files");
+    if (!BuildDir || !FileList || FileList->empty()) {
+        return llvm::createStringError(std::errc::invalid_argument, "'build_dir' and non-empty 'files' are required");
+    }
+
+    RefactorOptions Options = State.Options;
+    if (auto checks = Params.getString("checks")) {
+        auto mask = parseChecks(*checks);
+        if (!mask) {
+            return llvm::createStringError(std::errc::invalid_argument, "unknown check in '%s'", checks->str().c_str());
+        }
+        Options.EnabledChecks = *mask;
+    }
+    if (auto filter = Params.getString("header_filter")) {
+        Options.HeaderFilter = filter->str();
+    }
+
+    DryRunFormat Format = DryRunFormat::Diff;
+    if (auto format = Params.getString("format")) {
+        if (*format == "stats") {
+            Format = DryRunFormat::Stats;
+        } else if (*format == "sarif") {
+            Format = DryRunFormat::Sarif;
+        } else if (*format != "diff") {
+            return llvm::createStringError(std::errc::invalid_argument, "unknown format '%s'", format->str().c_str());
+        }
+    }
+
+    std::vector<std::string> Files;
+    for (const llvm::json::Value &file : *FileList) {
+        auto path = file.getAsString();
+        if (!path) {
+            return llvm::createStringError(std::errc::invalid_argument, "'files' must be an array of strings");
+        }
+        llvm::SmallString<256> absolute(*path);
+        llvm::sys::fs::make_absolute(*BuildDir, absolute);
+        llvm::sys::path::remove_dots(absolute, /*remove_dot_dot=*/true);
+        Files.push_back(std::string(absolute.str()));
+    }
+
+    auto Database = State.database(*BuildDir);
+    if (!Database) {
+        return Database.takeError();
+    }
+
+    // Кэш файлов свой у каждого запроса: между запросами файлы меняются, а следить за ними здесь некому.
+    std::optional<SharedFileCache> FileContents;
+    if (FileCache) {
+        FileContents.emplace();
+    }
+    PreambleCache *Preambles = State.Preambles ? &*State.Preambles : nullptr;
+    SharedFileCache *SharedFiles = FileContents ? &*FileContents : nullptr;
+
+    ReplacementsCollector Collector;
+    if (Params.getBoolean("apply").value_or(false)) {
+        const int rc = runParallel(*Database, Files, Jobs, Options, Collector, State.Cache ? &*State.Cache : nullptr,
+                                   Preambles, SharedFiles, nullptr, nullptr, nullptr, &State.Pool);
+        const size_t edits = Collector.pendingEdits();
+        // Разбор идёт параллельно с другими запросами, а запись - нет: два запроса, правящие один файл,
+        // применяют правки по очереди, и второй увидит по хэшу, что файл изменился после его разбора.
+        const std::vector<std::string> Written = Collector.editedFiles();
+        State.lockFiles(Written);
+        const bool applied = Collector.apply();
+        State.unlockFiles(Written);
+        return llvm::json::Object{{"ok", rc == 0 && applied}, {"edits", static_cast<int64_t>(edits)}};
+    }
+
+    Collector.keepClaimHashesOnly();
+    std::string Output;
+    llvm::raw_string_ostream OS(Output);
+    DryRunReport Report(OS, Format);
+    const int rc = runParallel(*Database, Files, Jobs, Options, Collector, nullptr, Preambles, SharedFiles, nullptr,
+                               &Report, nullptr, &State.Pool);
+    Report.finish();
+    return llvm::json::Object{{"ok", rc == 0}, {"output", std::move(Output)}};
+}
+
+static llvm::json::Value rpcError(llvm::json::Value Id, int Code, llvm::StringRef Message) {
+    return llvm::json::Object{{"jsonrpc", "2.0"},
+                              {"id", std::move(Id)},
+                              {"error", llvm::json::Object{{"code", Code}, {"message", Message.str()}}}};
+}
+
+// Обрабатывает одно сообщение JSON-RPC 2.0. Для уведомлений (без id) ответа нет - возвращается std::nullopt.
+static std::optional<llvm::json::Value> handleMessage(const llvm::json::Value &Message, ServerState &State) {
+    const llvm::json::Object *Request = Message.getAsObject();
+    if (!Request) {
+        return rpcError(nullptr, -32600, "Invalid Request");
+    }
+    const llvm::json::Value *RequestId = Request->get("id");
+    llvm::json::Value Id = RequestId ? *RequestId : llvm::json::Value(nullptr);
+
+    llvm::json::Value Response = nullptr;
+    auto Method = Request->getString("method");
+    if (!Method) {
+        Response = rpcError(std::move(Id), -32600, "Invalid Request");
+    } else if (*Method == "refactor") {
+        static const llvm::json::Object NoParams;
+        const llvm::json::Object *Params = Request->getObject("params");
+        auto Result = handleRefactor(Params ? *Params : NoParams, State);
+        if (Result) {
+            Response = llvm::json::Object{{"jsonrpc", "2.0"}, {"id", std::move(Id)}, {"result", std::move(*Result)}};
+        } else {
+            Response = rpcError(std::move(Id), -32602, llvm::toString(Result.takeError()));
+        }
+    } else if (*Method == "shutdown") {
+        State.Server.shutdown();
+        Response = llvm::json::Object{{"jsonrpc", "2.0"}, {"id", std::move(Id)}, {"result", nullptr}};
+    } else {
+        Response = rpcError(std::move(Id), -32601, "Method not found: " + Method->str());
+    }
+
+    if (!RequestId) {
+        return std::nullopt;
+    }
+    return Response;
+}
+
+// Сообщения и ответы - по одному JSON на строку; массив в строке - пакет запросов (batch).
+static void serveConnection(LocalSocketConnection &Connection, ServerState &State) {
+    std::string Line;
+    while (Connection.readLine(Line)) {
+        if (llvm::StringRef(Line).trim().empty()) {
+            continue;
+        }
+
+        std::optional<llvm::json::Value> Reply;
+        auto Message = llvm::json::parse(Line);
+        if (!Message) {
+            llvm::consumeError(Message.takeError());
+            Reply = rpcError(nullptr, -32700, "Parse error");
+        } else if (const llvm::json::Array *Batch = Message->getAsArray()) {
+            llvm::json::Array Replies;
+            for (const llvm::json::Value &Item : *Batch) {
+                if (auto ItemReply = handleMessage(Item, State)) {
+                    Replies.push_back(std::move(*ItemReply));
+                }
+            }
+            if (Batch->empty()) {
+                Reply = rpcError(nullptr, -32600, "Invalid Request");
+            } else if (!Replies.empty()) {
+                Reply = std::move(Replies);
+            }
+        } else {
+            Reply = handleMessage(*Message, State);
+        }
+
+        if (Reply && !Connection.write(llvm::formatv("{0}\n", *Reply).str())) {
+            return;
+        }
+    }
+}
+
+// refactor_tool serve --socket=<путь>: остаётся запущенным и отвечает на запросы JSON-RPC 2.0
+// по Unix domain socket. Запуск LLVM, разбор баз компиляции и собранные преамбулы не повторяются
+// от запроса к запросу. У каждого соединения свой поток, а TU всех запросов разбирает общий пул
+// на --jobs потоков. После "shutdown" новые соединения не принимаются, и процесс завершается,
+// когда закроются открытые.
+static int runServe(int argc, const char **argv) {
+    std::vector<const char *> Args{argv[0]};
+    Args.insert(Args.end(), argv + 2, argv + argc);
+    llvm::cl::HideUnrelatedOptions(ToolCategory);
+    if (!llvm::cl::ParseCommandLineOptions(static_cast<int>(Args.size()), Args.data(),
+                                           "refactor_tool serve: answers JSON-RPC requests on a local socket\n")) {
+        return 1;
+    }
+    if (Socket.empty()) {
+        llvm::errs() << "refactor_tool serve: --socket is required\n";
+        return 1;
+    }
+    auto Options = makeOptions();
+    if (!Options) {
+        return 1;
+    }
+
+    LocalSocketServer Server(Socket);
+    if (!Server.isValid()) {
+        llvm::errs() << "Cannot listen on " << Socket << ": " << Server.error() << "\n";
+        return 1;
+    }
+
+    llvm::DefaultThreadPool Pool(llvm::hardware_concurrency(Jobs));
+    ServerState State{std::move(*Options), std::nullopt, std::nullopt, Server, Pool};
+    if (!CacheDir.empty()) {
+        State.Cache.emplace(CacheDir);
+    }
+    if (ReusePreamble) {
+        State.Preambles.emplace();
+    }
+
+    // Потоки соединений отсоединены, чтобы завершившиеся не копились до выхода; runServe ждёт их по счётчику.
+    std::mutex ConnectionsMutex;
+    std::condition_variable ConnectionClosed;
+    unsigned Connections = 0;
+    while (std::unique_ptr<LocalSocketConnection> Connection = Server.accept()) {
+        {
+            std::lock_guard<std::mutex> lock(ConnectionsMutex);
+            ++Connections;
+        }
+        std::thread([&, Connection = std::move(Connection)] {
+            serveConnection(*Connection, State);
+            std::lock_guard<std::mutex> lock(ConnectionsMutex);
+            --Connections;
+            ConnectionClosed.notify_all();
+        }).detach();
+    }
+    std::unique_lock<std::mutex> lock(ConnectionsMutex);
+    ConnectionClosed.wait(lock, [&] { return Connections == 0; });
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    if (argc >= 2 && llvm::StringRef(argv[1]) == "merge") {
+        return runMerge(llvm::ArrayRef<const char *>(argv + 2, argc - 2));
+    }
+    if (argc >= 2 && llvm::StringRef(argv[1]) == "serve") {
+        return runServe(argc, argv);
+    }
+
+    // Парсер опций: Обрабатывает флаги командной строки, компиляционные базы данных.
+    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory);
+    if (!ExpectedParser) {
+        llvm::errs() << ExpectedParser.takeError();
+        return 1;
+    }
+    CommonOptionsParser &OptionsParser = ExpectedParser.get();
+
+    auto ParsedOptions = makeOptions();
+    if (!ParsedOptions) {
+        return 1;
+    }
+    RefactorOptions Options = std::move(*ParsedOptions);
+
+    if (DryRun && (Watch || !ExportFixes.empty())) {
+        llvm::errs() << "--dry-run cannot be combined with --watch or --export-fixes\n";
+        return 1;
+    }
+
+    std::vector<std::string> SourcePaths = OptionsParser.getSourcePathList();
+    if (!Shard.empty()) {
+        auto shard = parseShard(Shard);
+        if (!shard) {
+            llvm::errs() << "Invalid --shard=" << Shard << ": expected I/N with 0 <= I < N\n";
+            return 1;
+        }
+        SourcePaths = selectShard(SourcePaths, shard->first, shard->second);
+    }
+
+    // В кэше нет содержимого файлов и предупреждений с правками, поэтому --dry-run разбирает каждую TU.
+    std::optional<ResultCache> Cache;
+    if (!CacheDir.empty() && !DryRun) {
+        Cache.emplace(CacheDir);
+    }
+
+    std::optional<PreambleCache> Preambles;
+    if (ReusePreamble) {
+        Preambles.emplace();
+    }
+
+    std::optional<SharedFileCache> Files;
+    if (FileCache) {
+        Files.emplace();
+    }
+
+    std::optional<RefactorStats> Stats;
+    if (PrintStats) {
+        Stats.emplace();
+    }
+
+    if (!TimeTrace.empty()) {
+        llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "refactor_tool");
+    }
+
+    // Иерархия собирается один раз до прогона; в --watch она не обновляется после правок.
+    if (WholeProgram) {
+        llvm::TimeTraceScope scope("ProgramHierarchy");
+        const auto started = std::chrono::steady_clock::now();
+        std::vector<std::string> AllFiles = OptionsParser.getCompilations().getAllFiles();
+        for (const std::string &File : OptionsParser.getSourcePathList()) {
+            if (std::find(AllFiles.begin(), AllFiles.end(), File) == AllFiles.end()) {
+                AllFiles.push_back(File);
+            }
+        }
+        auto Program = ProgramHierarchy::collect(OptionsParser.getCompilations(), AllFiles, Jobs);
+        if (!Program) {
+            llvm::errs() << "--whole-program: some translation units failed to parse, "
+                            "the class hierarchy would be incomplete\n";
+            return 1;
+        }
+        Options.Program = std::make_shared<const ProgramHierarchy>(std::move(*Program));
+        if (Stats) {
+            Stats->addPhase("class hierarchy", elapsedMs(started));
+        }
+    }
+
+    if (Watch) {
+        return runWatch(OptionsParser.getCompilations(), SourcePaths, Options, Cache ? &*Cache : nullptr,
+                        Files ? &*Files : nullptr);
+    }
+
+    // Правки копятся со всех TU и пишутся на диск один раз в конце: так заголовок,
+    // включённый в несколько TU, правится один раз, а параллельные потоки не пишут в один файл.
+    ReplacementsCollector Collector;
+    if (!ExportFixes.empty() && !Collector.exportTo(ExportFixes)) {
+        return 1;
+    }
+
+    // В --dry-run Collector только отсеивает правки общих заголовков, уже показанные для другой TU.
+    std::optional<DryRunReport> Report;
+    if (DryRun) {
+        Collector.keepClaimHashesOnly();
+        Report.emplace(llvm::outs(), Format);
+    }
+
+    int rc = runParallel(OptionsParser.getCompilations(), SourcePaths, Jobs, Options, Collector,
+                         Cache ? &*Cache : nullptr, Preambles ? &*Preambles : nullptr, Files ? &*Files : nullptr,
+                         Stats ? &*Stats : nullptr, Report ? &*Report : nullptr);
+
+    if (Report) {
+        Report->finish();
+    } else {
+        llvm::TimeTraceScope scope("ApplyEdits");
+        const auto started = std::chrono::steady_clock::now();
+        bool ok = ExportFixes.empty() ? Collector.apply() : Collector.finishExport();
+        if (Stats) {
+            Stats->addPhase(ExportFixes.empty() ? "apply edits" : "export fixes", elapsedMs(started));
+        }
+        rc = ok ? rc : 1;
+    }
+
+    if (Stats) {
+        Stats->print(llvm::errs());
+    }
+
+    if (!TimeTrace.empty()) {
+        std::error_code ec;
+        llvm::raw_fd_ostream out(TimeTrace, ec, llvm::sys::fs::OF_Text);
+        if (ec) {
+            llvm::errs() << "Error writing " << TimeTrace << ": " << ec.message() << "\n";
+            rc = 1;
+        } else {
+            llvm::timeTraceProfilerWrite(out);
+        }
+        llvm::timeTraceProfilerCleanup();
+    }
+    return rc;
+}
@@ -1,10 +1,19 @@
+#include "DryRunReport.h"
+#include "LexicalPrefilter.h"
+#include "RefactorTool.h"
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <streambuf>
 #include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
 
 using namespace std::string_literals;
 namespace fs = std::filesystem;
@@ -20,31 +29,17 @@ std::string get_file_contents(const fs::path &path) {
     return content;
 }
 
-std::string run_refactor_tool(const fs::path &path) {
-    auto cmd = "./refactor_tool "s + path.string() + " --"s;
-    int rc = system(cmd.c_str());
-    EXPECT_EQ(rc, 0) << "failed to run refactor_tool";
-
-    auto content = get_file_contents(path);
-    fs::remove(path);
-
-    return content;
+// helper function for getting refactored content
+// Рефакторинг идёт в процессе и в памяти, поэтому тесты не делят временные файлы и шардируются.
+std::string get_refactored_contents(const std::string &content, const RefactorOptions &options = {}) {
+    auto result = refactor(content, options);
+    EXPECT_TRUE(result.has_value()) << "failed to refactor";
+    return result.value_or(content);
 }
 
 // helper function for getting refactored content from test file
-std::string get_refactored_file_contents(const std::string &test_name) {
-    auto src_file = fs::path{"../tests/tests_data/"s + test_name + ".cpp"s};
-    auto tmp_file = fs::path{"../tests/tests_data/tmp/"s + test_name + "_tmp.cpp"s};
-    fs::copy_file(src_file, tmp_file, fs::copy_options::overwrite_existing);
-
-    return run_refactor_tool(tmp_file);
-}
-
-// helper function for getting refactored content
-std::string get_refactored_contents(const std::string &content) {
-    auto tmp_file = fs::path{"../tests/tests_data/tmp/tmp.cpp"s};
-    write_file(tmp_file, content);
-    return run_refactor_tool(tmp_file);
+std::string get_refactored_file_contents(const std::string &test_name, const RefactorOptions &options = {}) {
+    return get_refactored_contents(get_file_contents("../tests/tests_data/"s + test_name + ".cpp"s), options);
 }
 
 class refactor_tool : public testing::TestWithParam<std::string> {};
@@ -79,6 +74,19 @@ TEST(refactor_tool_ext, nv_dtor_negative) {
     EXPECT_EQ(actual, expected);
 }
 
+TEST(refactor_tool_ext, nv_dtor_indirect_descendants) {
+    const auto testcode = "struct A { ~A(); }; "
+                          "struct B : A { ~B(); }; "
+                          "struct C : B { ~C(); }; "
+                          "struct D { ~D(); };"s;
+    const auto expected = "struct A { virtual ~A(); }; "
+                          "struct B : A { virtual ~B(); }; "
+                          "struct C : B { ~C(); }; "
+                          "struct D { ~D(); };"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
 TEST(refactor_tool_ext, miss_override_positive) {
     const auto testcode = "struct Base { "
                           "  virtual ~Base(); "
@@ -110,13 +118,13 @@ TEST(refactor_tool_ext, miss_override_negative) {
 }
 
 TEST(refactor_tool_ext, crange_for_positive) {
-    const auto testcode = "void f() { "
-                          "  using big_item_t = int[1'000'000]; "
+    const auto testcode = "struct big_item_t { int data[1'000]; }; "
+                          "void f() { "
                           "  big_item_t big_items[100]; "
                           "  for (const auto big_item : big_items) {} "
                           "}"s;
-    const auto expected = "void f() { "
-                          "  using big_item_t = int[1'000'000]; "
+    const auto expected = "struct big_item_t { int data[1'000]; }; "
+                          "void f() { "
                           "  big_item_t big_items[100]; "
                           "  for (const auto& big_item : big_items) {} "
                           "}"s;
@@ -124,6 +132,62 @@ TEST(refactor_tool_ext, crange_for_positive) {
     EXPECT_EQ(actual, expected);
 }
 
+TEST(refactor_tool_ext, crange_for_cheap_copy) {
+    // Массив из массивов: auto выводит указатель, копировать его дёшево.
+    const auto testcode = "struct point { int x, y; }; "
+                          "void f() { "
+                          "  using big_item_t = int[1'000'000]; "
+                          "  big_item_t big_items[100]; "
+                          "  for (const auto big_item : big_items) {} "
+                          "  point points[10]; "
+                          "  for (const point p : points) {} "
+                          "}"s;
+    EXPECT_EQ(get_refactored_contents(testcode), testcode);
+
+    // Порог настраивается: при 4 байтах point (8 байт) уже считается дорогим.
+    RefactorOptions options;
+    options.RangeForCopyThreshold = 4;
+    const auto actual = get_refactored_contents(testcode, options);
+    EXPECT_NE(actual.find("for (const point& p : points)"), std::string::npos) << actual;
+    EXPECT_NE(actual.find("for (const auto big_item : big_items)"), std::string::npos) << actual;
+}
+
+TEST(refactor_tool_ext, crange_for_non_const) {
+    const auto testcode = "#include <string>\n"
+                          "#include <vector>\n"
+                          "void f(std::vector<std::string> &names) {\n"
+                          "  unsigned long total = 0;\n"
+                          "  for (auto name : names) { total += name.size(); }\n"
+                          "  for (std::string name : names) { name += '!'; }\n"
+                          "}\n"s;
+    const auto expected = "#include <string>\n"
+                          "#include <vector>\n"
+                          "void f(std::vector<std::string> &names) {\n"
+                          "  unsigned long total = 0;\n"
+                          "  for (const auto& name : names) { total += name.size(); }\n"
+                          "  for (std::string name : names) { name += '!'; }\n"
+                          "}\n"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(refactor_tool_ext, crange_for_map_pair) {
+    const auto testcode = "#include <map>\n"
+                          "#include <string>\n"
+                          "void f(const std::map<int, std::string> &m) {\n"
+                          "  for (std::pair<int, std::string> p : m) { (void)p.second.size(); }\n"
+                          "  for (auto p : m) { (void)p.second.size(); }\n"
+                          "}\n"s;
+    const auto expected = "#include <map>\n"
+                          "#include <string>\n"
+                          "void f(const std::map<int, std::string> &m) {\n"
+                          "  for (const auto& p : m) { (void)p.second.size(); }\n"
+                          "  for (const auto& p : m) { (void)p.second.size(); }\n"
+                          "}\n"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
 TEST(refactor_tool_ext, crange_for_negative) {
     const auto testcode = "void f() { "
                           "  using big_item_t = int[1'000'000]; "
@@ -138,3 +202,702 @@ TEST(refactor_tool_ext, crange_for_negative) {
     const auto actual = get_refactored_contents(testcode);
     EXPECT_EQ(actual, expected);
 }
+
+TEST(refactor_tool_ext, value_param_const_ref) {
+    const auto testcode = "#include <string>\n"
+                          "#include <vector>\n"
+                          "unsigned long count_names(std::vector<std::string> names);\n"
+                          "unsigned long count_names(std::vector<std::string> names) { return names.size(); }\n"
+                          "void append(std::string s, std::vector<std::string> &out) { s += '!'; out.push_back(s); }\n"
+                          "std::string echo(std::string s) { return s; }\n"
+                          "struct point { int x, y; };\n"
+                          "int sum(point p) { return p.x + p.y; }\n"
+                          "void (*callback)(std::string) = nullptr;\n"
+                          "void log_message(std::string message) {}\n"
+                          "void init() { callback = log_message; }\n"s;
+    const auto expected = "#include <string>\n"
+                          "#include <vector>\n"
+                          "unsigned long count_names(const std::vector<std::string>& names);\n"
+                          "unsigned long count_names(const std::vector<std::string>& names) { return names.size(); }\n"
+                          "void append(std::string s, std::vector<std::string> &out) { s += '!'; out.push_back(s); }\n"
+                          "std::string echo(std::string s) { return s; }\n"
+                          "struct point { int x, y; };\n"
+                          "int sum(point p) { return p.x + p.y; }\n"
+                          "void (*callback)(std::string) = nullptr;\n"
+                          "void log_message(std::string message) {}\n"
+                          "void init() { callback = log_message; }\n"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(refactor_tool_ext, value_param_move_into_member) {
+    const auto testcode = "#include <string>\n"
+                          "#include <utility>\n"
+                          "struct user {\n"
+                          "  user(std::string name) : name_(name) {}\n"
+                          "  void rename(std::string name) { name_ = name; }\n"
+                          "  std::string name_;\n"
+                          "};\n"s;
+    const auto expected = "#include <string>\n"
+                          "#include <utility>\n"
+                          "struct user {\n"
+                          "  user(std::string name) : name_(std::move(name)) {}\n"
+                          "  void rename(std::string name) { name_ = std::move(name); }\n"
+                          "  std::string name_;\n"
+                          "};\n"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(refactor_tool_ext, reserve_positive) {
+    const auto testcode = "#include <string>\n"
+                          "#include <vector>\n"
+                          "std::vector<int> squares(const std::vector<int> &xs) {\n"
+                          "    std::vector<int> out;\n"
+                          "    for (int x : xs) {\n"
+                          "        out.push_back(x * x);\n"
+                          "    }\n"
+                          "    return out;\n"
+                          "}\n"
+                          "std::string dashes(unsigned n) {\n"
+                          "    std::string s;\n"
+                          "    for (int i = 0; i < n; ++i)\n"
+                          "        s.push_back('-');\n"
+                          "    return s;\n"
+                          "}\n"s;
+    const auto expected = "#include <string>\n"
+                          "#include <vector>\n"
+                          "std::vector<int> squares(const std::vector<int> &xs) {\n"
+                          "    std::vector<int> out;\n"
+                          "    out.reserve(xs.size());\n"
+                          "    for (int x : xs) {\n"
+                          "        out.push_back(x * x);\n"
+                          "    }\n"
+                          "    return out;\n"
+                          "}\n"
+                          "std::string dashes(unsigned n) {\n"
+                          "    std::string s;\n"
+                          "    s.reserve(n);\n"
+                          "    for (int i = 0; i < n; ++i)\n"
+                          "        s.push_back('-');\n"
+                          "    return s;\n"
+                          "}\n"s;
+    const auto actual = get_refactored_contents(testcode);
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(refactor_tool_ext, reserve_negative) {
+    const auto testcode = "#include <vector>\n"
+                          "void positives(const std::vector<int> &xs, std::vector<int> &out) {\n"
+                          "    for (int x : xs) out.push_back(x);\n"
+                          "}\n"
+                          "std::vector<int> filtered(const std::vector<int> &xs) {\n"
+                          "    std::vector<int> out;\n"
+                          "    for (int x : xs) {\n"
+                          "        if (x > 0) out.push_back(x);\n"
+                          "    }\n"
+                          "    return out;\n"
+                          "}\n"
+                          "std::vector<int> reserved(const std::vector<int> &xs) {\n"
+                          "    std::vector<int> out;\n"
+                          "    out.reserve(xs.size());\n"
+                          "    for (int x : xs) out.push_back(x);\n"
+                          "    return out;\n"
+                          "}\n"
+                          "std::vector<int> until_zero(const std::vector<int> &xs) {\n"
+                          "    std::vector<int> out;\n"
+                          "    for (int x : xs) {\n"
+                          "        if (x == 0) break;\n"
+                          "        out.push_back(x);\n"
+                          "    }\n"
+                          "    return out;\n"
+                          "}\n"
+                          "std::vector<int> counted(int n) {\n"
+                          "    std::vector<int> out;\n"
+                          "    for (int i = 0; i < n; ++i) out.push_back(i);\n"
+                          "    return out;\n"
+                          "}\n"s;
+    EXPECT_EQ(get_refactored_contents(testcode), testcode);
+}
+
+TEST(refactor_tool_ext, parallel_jobs) {
+    const auto tests = {"test1"s, "test2"s, "test3"s};
+
+    auto cmd = "./refactor_tool --jobs=3"s;
+    for (const auto &test_name : tests) {
+        auto src_file = fs::path{"../tests/tests_data/"s + test_name + ".cpp"s};
+        auto tmp_file = fs::path{"../tests/tests_data/tmp/"s + test_name + "_jobs.cpp"s};
+        fs::copy_file(src_file, tmp_file, fs::copy_options::overwrite_existing);
+        cmd += " "s + tmp_file.string();
+    }
+    cmd += " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    for (const auto &test_name : tests) {
+        auto tmp_file = fs::path{"../tests/tests_data/tmp/"s + test_name + "_jobs.cpp"s};
+        const auto expected = get_file_contents(fs::path{"../tests/tests_data/"s + test_name + "_ref.cpp"s});
+        EXPECT_EQ(expected, get_file_contents(tmp_file)) << test_name;
+        fs::remove(tmp_file);
+    }
+}
+
+TEST(refactor_tool_ext, shared_header_refactored_once) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/"s};
+    write_file(dir / "shared_hdr.h", "struct Base { ~Base(); virtual void f(); };\n"s);
+    write_file(dir / "shared_a.cpp", "#include \"shared_hdr.h\"\nstruct A : Base { void f(); };\n"s);
+    write_file(dir / "shared_b.cpp", "#include \"shared_hdr.h\"\nstruct B : Base { void f(); };\n"s);
+
+    auto cmd = "./refactor_tool --header-filter=shared_hdr "s + (dir / "shared_a.cpp").string() + " "s +
+               (dir / "shared_b.cpp").string() + " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    EXPECT_EQ(get_file_contents(dir / "shared_hdr.h"), "struct Base { virtual ~Base(); virtual void f(); };\n"s);
+    EXPECT_EQ(get_file_contents(dir / "shared_a.cpp"), "#include \"shared_hdr.h\"\nstruct A : Base { void f() override; };\n"s);
+    EXPECT_EQ(get_file_contents(dir / "shared_b.cpp"), "#include \"shared_hdr.h\"\nstruct B : Base { void f() override; };\n"s);
+
+    for (const auto *name : {"shared_hdr.h", "shared_a.cpp", "shared_b.cpp"}) {
+        fs::remove(dir / name);
+    }
+}
+
+TEST(refactor_tool_ext, whole_program_final) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/"s};
+    const auto header = "struct Shape { virtual ~Shape(); virtual int sides() const = 0; };\n"
+                        "struct Widget { virtual void draw(); };\n"s;
+    const auto source_a = "#include \"final_hdr.h\"\n"
+                          "struct Triangle : Shape { int sides() const override { return 3; } };\n"
+                          "struct Plain { int x; };\n"s;
+    const auto source_b = "#include \"final_hdr.h\"\n"
+                          "struct Button : Widget { void draw() override; };\n"s;
+    write_file(dir / "final_hdr.h", header);
+    write_file(dir / "final_a.cpp", source_a);
+    write_file(dir / "final_b.cpp", source_b);
+    const auto files = " "s + (dir / "final_a.cpp").string() + " "s + (dir / "final_b.cpp").string() + " --"s;
+
+    // Без иерархии всей программы лист не определить, и проверка не запускается.
+    auto cmd = "./refactor_tool --checks=final --header-filter=final_hdr"s + files;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    EXPECT_EQ(get_file_contents(dir / "final_a.cpp"), source_a);
+
+    // Widget не лист: наследник Button есть только в final_b.cpp.
+    cmd = "./refactor_tool --whole-program --checks=final --header-filter=final_hdr"s + files;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    EXPECT_EQ(get_file_contents(dir / "final_hdr.h"), header);
+    EXPECT_EQ(get_file_contents(dir / "final_a.cpp"),
+              "#include \"final_hdr.h\"\n"
+              "struct Triangle final : Shape { int sides() const override { return 3; } };\n"
+              "struct Plain { int x; };\n"s);
+    EXPECT_EQ(get_file_contents(dir / "final_b.cpp"),
+              "#include \"final_hdr.h\"\n"
+              "struct Button final : Widget { void draw() override; };\n"s);
+
+    for (const auto *name : {"final_hdr.h", "final_a.cpp", "final_b.cpp"}) {
+        fs::remove(dir / name);
+    }
+}
+
+TEST(refactor_tool_ext, atomic_single_write) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/atomic"s};
+    fs::create_directories(dir);
+    write_file(dir / "atomic_hdr.h", "struct Base { ~Base(); virtual void f(); };\n"s);
+    write_file(dir / "atomic_a.cpp", "#include \"atomic_hdr.h\"\nstruct A : Base { void f(); };\n"s);
+    write_file(dir / "atomic_b.cpp", "#include \"atomic_hdr.h\"\nstruct B : Base { void f(); };\n"s);
+    const auto perms = fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::others_read;
+    fs::permissions(dir / "atomic_hdr.h", perms);
+
+    auto cmd = "./refactor_tool --header-filter=atomic_hdr "s + (dir / "atomic_a.cpp").string() + " "s +
+               (dir / "atomic_b.cpp").string() + " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    // Заголовок из двух TU исправлен один раз, через rename: права сохранены, временных файлов не осталось.
+    EXPECT_EQ(get_file_contents(dir / "atomic_hdr.h"), "struct Base { virtual ~Base(); virtual void f(); };\n"s);
+    EXPECT_EQ(fs::status(dir / "atomic_hdr.h").permissions() & fs::perms::all, perms);
+    EXPECT_EQ(std::distance(fs::directory_iterator(dir), fs::directory_iterator{}), 3);
+
+    fs::remove_all(dir);
+}
+
+TEST(refactor_tool_ext, export_fixes) {
+    const auto testcode = "struct Base { ~Base(); }; "
+                          "struct Derived : Base {};"s;
+    const auto tmp_file = fs::path{"../tests/tests_data/tmp/export.cpp"s};
+    const auto fixes_file = fs::path{"../tests/tests_data/tmp/export.yaml"s};
+    write_file(tmp_file, testcode);
+
+    auto cmd = "./refactor_tool --export-fixes="s + fixes_file.string() + " "s + tmp_file.string() + " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    // Исходник не меняется, правка попадает в YAML.
+    EXPECT_EQ(get_file_contents(tmp_file), testcode);
+    const auto fixes = get_file_contents(fixes_file);
+    EXPECT_NE(fixes.find("export.cpp\""s), std::string::npos);
+    EXPECT_NE(fixes.find("Offset:          14\n"s), std::string::npos);
+    EXPECT_NE(fixes.find("ReplacementText: \"virtual \"\n"s), std::string::npos);
+
+    fs::remove(tmp_file);
+    fs::remove(fixes_file);
+}
+
+TEST(refactor_tool_ext, dry_run) {
+    const auto testcode = "struct Base { ~Base(); };\n"
+                          "struct Derived : Base {};\n"s;
+    const auto tmp_file = fs::path{"../tests/tests_data/tmp/dry_run.cpp"s};
+    const auto out_file = fs::path{"../tests/tests_data/tmp/dry_run.out"s};
+    write_file(tmp_file, testcode);
+
+    auto run = [&](const std::string &format) {
+        auto cmd = "./refactor_tool --dry-run --format="s + format + " "s + tmp_file.string() + " -- > "s +
+                   out_file.string();
+        EXPECT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+        return get_file_contents(out_file);
+    };
+
+    const auto diff = run("diff");
+    EXPECT_NE(diff.find("@@ -1,2 +1,2 @@\n"
+                        "-struct Base { ~Base(); };\n"
+                        "+struct Base { virtual ~Base(); };\n"
+                        " struct Derived : Base {};\n"s),
+              std::string::npos);
+
+    const auto sarif = run("sarif");
+    EXPECT_NE(sarif.find("\"version\":\"2.1.0\""s), std::string::npos);
+    EXPECT_NE(sarif.find("\"ruleId\":\"nv-dtor\""s), std::string::npos);
+    EXPECT_NE(sarif.find("\"insertedContent\":{\"text\":\"virtual \"}"s), std::string::npos);
+
+    EXPECT_NE(run("stats").find("Dry run: 1 edit(s) in 1 file(s) from 1 translation unit(s)"s), std::string::npos);
+
+    // Исходник не меняется ни в одном из форматов.
+    EXPECT_EQ(get_file_contents(tmp_file), testcode);
+
+    fs::remove(tmp_file);
+    fs::remove(out_file);
+}
+
+TEST(refactor_tool_ext, dry_run_shared_header) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/dry_run_header"s};
+    const auto out_file = dir / "out.diff";
+    fs::create_directories(dir);
+    write_file(dir / "dry_hdr.h", "struct Base { ~Base(); };\nstruct Other { ~Other(); };\n"s);
+    write_file(dir / "dry_a.cpp", "#include \"dry_hdr.h\"\nstruct A : Base {};\n"s);
+    write_file(dir / "dry_b.cpp", "#include \"dry_hdr.h\"\nstruct B : Other {};\n"s);
+
+    auto cmd = "./refactor_tool --dry-run --header-filter=dry_hdr --jobs=2 "s + (dir / "dry_a.cpp").string() + " "s +
+               (dir / "dry_b.cpp").string() + " -- > "s + out_file.string();
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    const auto diff = get_file_contents(out_file);
+
+    // Правки обеих TU в общем заголовке - один дифф: два диффа одного файла git apply и patch не примут.
+    size_t files = 0;
+    for (auto pos = diff.find("\n+++ "s); pos != std::string::npos; pos = diff.find("\n+++ "s, pos + 1)) {
+        ++files;
+    }
+    EXPECT_EQ(files, 1u);
+    EXPECT_NE(diff.find("-struct Base { ~Base(); };\n"
+                        "+struct Base { virtual ~Base(); };\n"
+                        "-struct Other { ~Other(); };\n"
+                        "+struct Other { virtual ~Other(); };\n"s),
+              std::string::npos);
+
+    fs::remove_all(dir);
+}
+
+TEST(refactor_tool_ext, unified_diff_hunks) {
+    const auto original = "l1\nl2\nl3\nl4\nl5\nl6\nl7\nl8\nl9\nl10"s;
+    clang::tooling::Replacements replaces;
+    ASSERT_FALSE(replaces.add(clang::tooling::Replacement("a.cpp", 3, 0, "x")));
+    ASSERT_FALSE(replaces.add(clang::tooling::Replacement("a.cpp", 27, 1, "L")));
+
+    std::string diff;
+    llvm::raw_string_ostream out(diff);
+    writeUnifiedDiff(out, "a/a.cpp", "b/a.cpp", original, replaces);
+    out.flush();
+
+    // Далёкие правки - отдельные блоки; последняя строка без '\n' помечается как в diff -u.
+    EXPECT_EQ(diff, "--- a/a.cpp\n+++ b/a.cpp\n"
+                    "@@ -1,5 +1,5 @@\n l1\n-l2\n+xl2\n l3\n l4\n l5\n"
+                    "@@ -7,4 +7,4 @@\n l7\n l8\n l9\n-l10\n\\ No newline at end of file\n"
+                    "+L10\n\\ No newline at end of file\n"s);
+}
+
+TEST(refactor_tool_ext, shard_and_merge) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/shards"s};
+    fs::create_directories(dir);
+    write_file(dir / "shard_hdr.h", "struct Base { ~Base(); virtual void f(); };\n"s);
+    std::string files;
+    for (const auto *name : {"shard_a.cpp", "shard_b.cpp", "shard_c.cpp"}) {
+        write_file(dir / name, "#include \"shard_hdr.h\"\nstruct "s + name[6] + " : Base { void f(); };\n"s);
+        files += " "s + (dir / name).string();
+    }
+
+    // Шарды независимы и ничего не меняют на диске; merge применяет их правки, заголовок - один раз.
+    for (int i = 0; i < 2; ++i) {
+        auto cmd = "./refactor_tool --header-filter=shard_hdr --shard="s + std::to_string(i) +
+                   "/2 --export-fixes="s + (dir / ("shard"s + std::to_string(i) + ".yaml"s)).string() + files +
+                   " --"s;
+        ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    }
+    EXPECT_EQ(get_file_contents(dir / "shard_hdr.h"), "struct Base { ~Base(); virtual void f(); };\n"s);
+
+    auto merge = "./refactor_tool merge "s + (dir / "shard0.yaml").string() + " "s + (dir / "shard1.yaml").string();
+    ASSERT_EQ(system(merge.c_str()), 0) << "failed to run refactor_tool merge";
+
+    EXPECT_EQ(get_file_contents(dir / "shard_hdr.h"), "struct Base { virtual ~Base(); virtual void f(); };\n"s);
+    for (const auto *name : {"shard_a.cpp", "shard_b.cpp", "shard_c.cpp"}) {
+        EXPECT_EQ(get_file_contents(dir / name),
+                  "#include \"shard_hdr.h\"\nstruct "s + name[6] + " : Base { void f() override; };\n"s);
+    }
+
+    fs::remove_all(dir);
+}
+
+TEST(refactor_tool_ext, result_cache) {
+    const auto testcode = "struct Base { ~Base(); }; "
+                          "struct Derived : Base {};"s;
+    const auto tmp_file = fs::path{"../tests/tests_data/tmp/cached.cpp"s};
+    const auto fixes_file = fs::path{"../tests/tests_data/tmp/cached.yaml"s};
+    const auto cache_dir = fs::path{"../tests/tests_data/tmp/cache"s};
+    write_file(tmp_file, testcode);
+    fs::remove_all(cache_dir);
+
+    auto cmd = "./refactor_tool --cache-dir="s + cache_dir.string() + " --export-fixes="s + fixes_file.string() +
+               " "s + tmp_file.string() + " --"s;
+
+    // Первый прогон заполняет кэш, второй должен выдать те же правки из него.
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    const auto first = get_file_contents(fixes_file);
+    EXPECT_FALSE(fs::is_empty(cache_dir));
+
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    EXPECT_EQ(get_file_contents(fixes_file), first);
+    EXPECT_NE(first.find("ReplacementText: \"virtual \"\n"s), std::string::npos);
+    // Хэш исходника из кэша нужен merge, чтобы заметить файл, изменившийся после прогона.
+    EXPECT_NE(get_file_contents(fixes_file).find("# SourceHash: "s), std::string::npos);
+
+    fs::remove(tmp_file);
+    fs::remove(fixes_file);
+    fs::remove_all(cache_dir);
+}
+
+TEST(refactor_tool_ext, reuse_preamble) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/"s};
+    const auto preamble = "#include <string>\n#include <vector>\n"s;
+    const auto code_a = preamble + "void a(const std::vector<std::string> &v) { for (const auto s : v) {} }\n"s;
+    const auto code_b = preamble + "struct B { ~B(); }; struct C : B {};\n"s;
+    write_file(dir / "preamble_a.cpp", code_a);
+    write_file(dir / "preamble_b.cpp", code_b);
+
+    // Обе TU начинаются с одинаковой преамбулы, вторая разбирается поверх уже собранной.
+    auto cmd = "./refactor_tool --reuse-preamble "s + (dir / "preamble_a.cpp").string() + " "s +
+               (dir / "preamble_b.cpp").string() + " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    EXPECT_EQ(get_file_contents(dir / "preamble_a.cpp"),
+              preamble + "void a(const std::vector<std::string> &v) { for (const auto& s : v) {} }\n"s);
+    EXPECT_EQ(get_file_contents(dir / "preamble_b.cpp"), preamble + "struct B { virtual ~B(); }; struct C : B {};\n"s);
+
+    fs::remove(dir / "preamble_a.cpp");
+    fs::remove(dir / "preamble_b.cpp");
+}
+
+TEST(refactor_tool_ext, reuse_preamble_per_directory) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/preamble_dirs"s};
+    fs::create_directories(dir / "one");
+    fs::create_directories(dir / "two");
+    write_file(dir / "one" / "config.h", "struct Base { virtual void f(); };\n"s);
+    write_file(dir / "two" / "config.h", "struct Base { virtual void g(); };\n"s);
+    write_file(dir / "one" / "a.cpp", "#include \"config.h\"\nstruct D : Base { void f(); };\n"s);
+    write_file(dir / "two" / "b.cpp", "#include \"config.h\"\nstruct D : Base { void g(); };\n"s);
+
+    // Текст преамбулы одинаковый, но "config.h" в каждом каталоге свой: преамбулу делить нельзя.
+    auto cmd = "./refactor_tool --reuse-preamble "s + (dir / "one" / "a.cpp").string() + " "s +
+               (dir / "two" / "b.cpp").string() + " --"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    EXPECT_EQ(get_file_contents(dir / "one" / "a.cpp"),
+              "#include \"config.h\"\nstruct D : Base { void f() override; };\n"s);
+    EXPECT_EQ(get_file_contents(dir / "two" / "b.cpp"),
+              "#include \"config.h\"\nstruct D : Base { void g() override; };\n"s);
+
+    fs::remove_all(dir);
+}
+
+TEST(refactor_tool_ext, skip_function_bodies) {
+    RefactorOptions options;
+    options.SkipFunctionBodies = true;
+    for (const auto &test_name : {"test1"s, "test2"s, "test3"s}) {
+        // Тела функций из <iostream> и т.п. не разбираются, но результат совпадает с эталоном.
+        const auto expected = get_file_contents(fs::path{"../tests/tests_data/"s + test_name + "_ref.cpp"s});
+        EXPECT_EQ(expected, get_refactored_file_contents(test_name, options)) << test_name;
+    }
+}
+
+TEST(refactor_tool_ext, checks_selection) {
+    const auto testcode = "struct Base { ~Base(); virtual void f(); }; "
+                          "struct Derived : Base { void f(); };"s;
+    const auto expected = "struct Base { ~Base(); virtual void f(); }; "
+                          "struct Derived : Base { void f() override; };"s;
+
+    RefactorOptions options;
+    options.EnabledChecks = parseChecks("override").value();
+    options.SkipFunctionBodies = true;
+    EXPECT_EQ(get_refactored_contents(testcode, options), expected);
+}
+
+TEST(refactor_tool_ext, refactor_invalid_code) { EXPECT_FALSE(refactor("struct Base { ~Base() }").has_value()); }
+
+TEST(refactor_tool_ext, stats_and_time_trace) {
+    const auto testcode = "struct Base { ~Base(); }; "
+                          "struct Derived : Base {};"s;
+    const auto tmp_file = fs::path{"../tests/tests_data/tmp/stats.cpp"s};
+    const auto stats_file = fs::path{"../tests/tests_data/tmp/stats.txt"s};
+    const auto trace_file = fs::path{"../tests/tests_data/tmp/stats.json"s};
+    write_file(tmp_file, testcode);
+
+    auto cmd = "./refactor_tool --stats --time-trace="s + trace_file.string() + " "s + tmp_file.string() +
+               " -- 2> "s + stats_file.string();
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+    // Сводка пишется в stderr, трасса - в формате Chrome trace.
+    const auto stats = get_file_contents(stats_file);
+    EXPECT_NE(stats.find("Translation units: 1 parsed"s), std::string::npos);
+    EXPECT_NE(stats.find("nv-dtor"s), std::string::npos);
+    EXPECT_NE(stats.find("Peak RSS:"s), std::string::npos);
+    EXPECT_NE(get_file_contents(trace_file).find("\"traceEvents\""s), std::string::npos);
+
+    fs::remove(tmp_file);
+    fs::remove(stats_file);
+    fs::remove(trace_file);
+}
+
+TEST(refactor_tool_ext, peak_rss_bounded) {
+    const auto dir = fs::path{"../tests/tests_data/tmp/corpus"s};
+    const auto stats_file = fs::path{"../tests/tests_data/tmp/corpus_stats.txt"s};
+    fs::create_directories(dir);
+    std::vector<std::string> files;
+    for (int i = 0; i < 500; ++i) {
+        files.push_back((dir / ("tu"s + std::to_string(i) + ".cpp"s)).string());
+        write_file(files.back(), "struct Base { ~Base(); virtual void f(); };\n"
+                                 "struct Derived : Base { void f(); };\n"
+                                 "struct Item { char data[64]; };\n"
+                                 "int first(const Item (&items)[8]) { for (Item item : items) return item.data[0]; "
+                                 "return 0; }\n"s);
+    }
+
+    // Пиковый RSS в МБ из сводки --stats после прогона по первым count TU.
+    auto peak_rss_mb = [&](size_t count) {
+        auto cmd = "./refactor_tool --dry-run --format=stats --jobs=4 --max-rss=4096 --stats"s;
+        for (size_t i = 0; i < count; ++i) {
+            cmd += " "s + files[i];
+        }
+        cmd += " -- > /dev/null 2> "s + stats_file.string();
+        EXPECT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+        const auto stats = get_file_contents(stats_file);
+        const auto pos = stats.find("Peak RSS: "s);
+        return pos == std::string::npos ? 0.0 : std::stod(stats.substr(pos + 10));
+    };
+
+    // Память освобождается после каждой TU, поэтому в 10 раз больший прогон почти не поднимает пик.
+    const double small = peak_rss_mb(50);
+    const double large = peak_rss_mb(files.size());
+    EXPECT_GT(small, 0.0);
+    EXPECT_LT(large, small + 64.0);
+
+    // Предел ниже следа одной TU: новые TU ждут, пока не закончится выполняющаяся, но прогон доходит до конца.
+    const auto out_file = dir / "out.txt"s;
+    auto cmd = "timeout 120 ./refactor_tool --dry-run --format=stats --jobs=4 --max-rss=1"s;
+    for (size_t i = 0; i < 20; ++i) {
+        cmd += " "s + files[i];
+    }
+    cmd += " -- > "s + out_file.string() + " 2> /dev/null"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+    EXPECT_NE(get_file_contents(out_file).find("from 20 translation unit(s)"s), std::string::npos);
+
+    fs::remove_all(dir);
+    fs::remove(stats_file);
+}
+
+TEST(refactor_tool_ext, clang_plugin) {
+    const auto clang = fs::path{CLANG_EXECUTABLE};
+    if (!fs::exists(clang)) {
+        GTEST_SKIP() << "clang++ not found: " << clang;
+    }
+
+    const auto testcode = "struct Base { ~Base(); }; "
+                          "struct Derived : Base {};"s;
+    const auto tmp_file = fs::path{"../tests/tests_data/tmp/plugin.cpp"s};
+    const auto fixes_file = fs::path{"../tests/tests_data/tmp/plugin.yaml"s};
+    write_file(tmp_file, testcode);
+
+    // Правки выдаёт обычная компиляция, исходник при этом не меняется.
+    auto cmd = clang.string() + " -fsyntax-only -fplugin="s + REFACTOR_PLUGIN_PATH +
+               " -fplugin-arg-refactor-export-fixes="s + fixes_file.string() + " "s + tmp_file.string();
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run clang with the plugin";
+
+    EXPECT_EQ(get_file_contents(tmp_file), testcode);
+    EXPECT_NE(get_file_contents(fixes_file).find("ReplacementText: \"virtual \"\n"s), std::string::npos);
+
+    fs::remove(tmp_file);
+    fs::remove(fixes_file);
+}
+
+TEST(refactor_tool_ext, watch_mode) {
+    const auto tmp_file = fs::absolute(fs::path{"../tests/tests_data/tmp/watched.cpp"s});
+    const auto pid_file = fs::path{"../tests/tests_data/tmp/watched.pid"s};
+    write_file(tmp_file, "struct A { ~A(); }; struct B : A {};\n"s);
+
+    // Ждёт, пока файл не примет ожидаемый вид (или не истечёт таймаут).
+    const auto wait_for = [&](const std::string &expected) {
+        for (int i = 0; i < 100 && get_file_contents(tmp_file) != expected; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return get_file_contents(tmp_file);
+    };
+
+    auto cmd = "timeout 60 ./refactor_tool --watch "s + tmp_file.string() + " -- > /dev/null 2>&1 & echo $! > "s +
+               pid_file.string();
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to start refactor_tool";
+
+    EXPECT_EQ(wait_for("struct A { virtual ~A(); }; struct B : A {};\n"s),
+              "struct A { virtual ~A(); }; struct B : A {};\n"s);
+
+    // Правка файла перезапускает только его TU без перезапуска процесса.
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    write_file(tmp_file, "struct C { ~C(); }; struct D : C {};\n"s);
+    EXPECT_EQ(wait_for("struct C { virtual ~C(); }; struct D : C {};\n"s),
+              "struct C { virtual ~C(); }; struct D : C {};\n"s);
+
+    system(("kill $(cat "s + pid_file.string() + ")"s).c_str());
+    fs::remove(tmp_file);
+    fs::remove(pid_file);
+}
+
+// Отправляет одну строку JSON-RPC в сокет refactor_tool serve и возвращает строку ответа.
+std::string rpc_call(const fs::path &socket_path, const std::string &request) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    socket_path.string().copy(address.sun_path, sizeof(address.sun_path) - 1);
+    std::string reply;
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0) {
+        const auto line = request + "\n"s;
+        EXPECT_EQ(write(fd, line.data(), line.size()), static_cast<ssize_t>(line.size()));
+        char c = 0;
+        while (read(fd, &c, 1) == 1 && c != '\n') {
+            reply += c;
+        }
+    }
+    close(fd);
+    return reply;
+}
+
+TEST(refactor_tool_ext, serve_json_rpc) {
+    const auto dir = fs::weakly_canonical(fs::absolute(fs::path{"../tests/tests_data/tmp/serve"s}));
+    const auto socket_path = fs::path{"../tests/tests_data/tmp/serve.sock"s};
+    fs::create_directories(dir);
+    write_file(dir / "serve.cpp", "struct Base { ~Base(); };\nstruct Derived : Base {};\n"s);
+    write_file(dir / "compile_commands.json",
+               R"([{"directory": ")"s + dir.string() + R"(", "file": "serve.cpp", "command": "c++ -c serve.cpp"}])"s);
+
+    auto cmd = "timeout 60 ./refactor_tool serve --socket="s + socket_path.string() + " > /dev/null 2>&1 &"s;
+    ASSERT_EQ(system(cmd.c_str()), 0) << "failed to start refactor_tool serve";
+    for (int i = 0; i < 100 && !fs::exists(socket_path); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    // Второй сервер на том же пути не запускается и не отбирает сокет у первого.
+    const auto second = "timeout 10 ./refactor_tool serve --socket="s + socket_path.string() + " > /dev/null 2>&1"s;
+    EXPECT_NE(system(second.c_str()), 0);
+
+    // Без apply ответ содержит дифф, а файл не меняется; с apply правка пишется на диск.
+    const auto request = R"({"jsonrpc": "2.0", "method": "refactor", "params": {"build_dir": ")"s + dir.string() +
+                         R"(", "files": ["serve.cpp"])"s;
+    const auto preview = rpc_call(socket_path, request + R"(}, "id": 1})"s);
+    EXPECT_NE(preview.find(R"("id":1)"s), std::string::npos) << preview;
+    EXPECT_NE(preview.find("+struct Base { virtual ~Base(); };"s), std::string::npos) << preview;
+    EXPECT_EQ(get_file_contents(dir / "serve.cpp"), "struct Base { ~Base(); };\nstruct Derived : Base {};\n"s);
+
+    const auto applied = rpc_call(socket_path, request + R"(, "apply": true}, "id": 2})"s);
+    EXPECT_NE(applied.find(R"("edits":1)"s), std::string::npos) << applied;
+    EXPECT_EQ(get_file_contents(dir / "serve.cpp"), "struct Base { virtual ~Base(); };\nstruct Derived : Base {};\n"s);
+
+    EXPECT_NE(rpc_call(socket_path, R"({"jsonrpc": "2.0", "method": "unknown", "id": 3})"s).find("-32601"s),
+              std::string::npos);
+
+    // После shutdown сервер завершается и удаляет файл сокета.
+    rpc_call(socket_path, R"({"jsonrpc": "2.0", "method": "shutdown", "id": 4})"s);
+    for (int i = 0; i < 100 && fs::exists(socket_path); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_FALSE(fs::exists(socket_path));
+
+    // Обычный файл по пути сокета не удаляется.
+    write_file(socket_path, "not a socket"s);
+    EXPECT_NE(system(second.c_str()), 0);
+    EXPECT_EQ(get_file_contents(socket_path), "not a socket"s);
+
+    fs::remove(socket_path);
+    fs::remove_all(dir);
+}
+
+TEST(refactor_tool_ext, shared_file_cache) {
+    const auto tests = {"test1"s, "test2"s, "test3"s};
+
+    // Все три TU включают <iostream>/<string>: с общим кэшем заголовки читаются с диска один раз.
+    for (const auto *jobs : {"1", "3"}) {
+        auto cmd = "./refactor_tool --file-cache --jobs="s + jobs;
+        for (const auto &test_name : tests) {
+            auto src_file = fs::path{"../tests/tests_data/"s + test_name + ".cpp"s};
+            auto tmp_file = fs::path{"../tests/tests_data/tmp/"s + test_name + "_vfs.cpp"s};
+            fs::copy_file(src_file, tmp_file, fs::copy_options::overwrite_existing);
+            cmd += " "s + tmp_file.string();
+        }
+        cmd += " --"s;
+        ASSERT_EQ(system(cmd.c_str()), 0) << "failed to run refactor_tool";
+
+        for (const auto &test_name : tests) {
+            auto tmp_file = fs::path{"../tests/tests_data/tmp/"s + test_name + "_vfs.cpp"s};
+            const auto expected = get_file_contents(fs::path{"../tests/tests_data/"s + test_name + "_ref.cpp"s});
+            EXPECT_EQ(expected, get_file_contents(tmp_file)) << test_name << " --jobs=" << jobs;
+            fs::remove(tmp_file);
+        }
+    }
+}
+
+TEST(refactor_tool_ext, lexical_prefilter) {
+    const RefactorOptions all;
+    EXPECT_FALSE(mayHaveCandidates("int f(int x) { for (int i = 0; i < x; ++i) {} return x ? 1 : 2; }", all));
+    EXPECT_FALSE(mayHaveCandidates("template <class T> struct S { T t; }; namespace a { int b = ::a::c; }", all));
+    EXPECT_TRUE(mayHaveCandidates("struct A { ~A(); };", all));
+    EXPECT_TRUE(mayHaveCandidates("struct B : A { void f(); };", all));
+    EXPECT_TRUE(mayHaveCandidates("void f(const V &v) { for (const auto x : v) {} }", all));
+    EXPECT_TRUE(mayHaveCandidates("#define LOOP(v) for (auto x : v)\n", all));
+    EXPECT_TRUE(mayHaveCandidates("void f(std::string s);", all));
+    EXPECT_TRUE(mayHaveCandidates("void f(Big) {}", all));
+    EXPECT_FALSE(mayHaveCandidates("int h(int x, const Big &b) { return g(x, b); }", all));
+    EXPECT_TRUE(mayHaveCandidates("int h() { v.push_back(1); }", all));
+
+    // Кандидаты выключенных проверок не считаются.
+    RefactorOptions override_only;
+    override_only.EnabledChecks = static_cast<unsigned>(Check::Override);
+    EXPECT_FALSE(mayHaveCandidates("struct A { ~A(); }; void f(const V &v) { for (auto x : v) {} }", override_only));
+    EXPECT_TRUE(mayHaveCandidates("struct alignas(16) D : Base {};", override_only));
+    EXPECT_TRUE(mayHaveCandidates("class __declspec(dllexport) D : public Base {};", override_only));
+
+    // Одиночный тип в скобках - параметр, если после скобок идут квалификаторы метода или requires.
+    RefactorOptions value_param_only;
+    value_param_only.EnabledChecks = static_cast<unsigned>(Check::ValueParam);
+    EXPECT_TRUE(mayHaveCandidates("struct S { void f(Big) & {} };", value_param_only));
+    EXPECT_TRUE(mayHaveCandidates("struct S { void f(Big) && {} };", value_param_only));
+    EXPECT_TRUE(mayHaveCandidates("template <class T> void f(Big) requires true {}", value_param_only));
+
+    // Range-for с инициализатором (C++20): ':' стоит после ';' в заголовке for.
+    RefactorOptions range_for_only;
+    range_for_only.EnabledChecks = static_cast<unsigned>(Check::RangeFor);
+    EXPECT_TRUE(mayHaveCandidates("void f() { for (auto v = get(); auto x : v) {} }", range_for_only));
+    EXPECT_FALSE(mayHaveCandidates("void f(int n) { for (int i = 0; i < n; ++i) {} }", range_for_only));
+
+    // С --header-filter правки возможны в заголовках, поэтому TU не пропускается.
+    RefactorOptions with_headers;
+    with_headers.HeaderFilter = ".*";
+    EXPECT_TRUE(mayHaveCandidates("int x;", with_headers));
+}